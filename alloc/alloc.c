@@ -0,0 +1,432 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Allocator scalability.  glibc hands out malloc arenas per kernel thread, so
+ * a few vcores worth of upthreads can end up fighting over the same arenas
+ * that hundreds of native pthreads would have spread across.  Each thread runs
+ * one of these patterns for 'duration' seconds:
+ *
+ *   churn - allocate 'batch' objects of 'obj_size' bytes, then free them all
+ *   xfer  - allocate a batch and hand it to the next thread, which frees it,
+ *           so every free is of memory some other thread allocated.  Only one
+ *           batch is ever waiting in a thread's inbox, so a receiver that
+ *           isn't getting to run holds the sender back instead of piling up
+ *           memory
+ *   mix   - keep 'batch' live objects of mixed sizes (mostly small, with a
+ *           tail out to 32KB), replacing a random one each time
+ *
+ * The allocator is either the C library's malloc or 'pool', a simple per-thread
+ * size-class allocator that never takes a lock, for comparison.  An op is one
+ * allocation and its free.  We report ops/s and how much the resident set grew
+ * over the run.
+ *
+ * usage: alloc [pattern] [nr_threads] [duration] [allocator] [obj_size]
+ *              [batch] [human] [preempt_period] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../libconfig.h"
+#include "../barrier.h"
+#include "../topology.h"
+#include "../results.h"
+#include "../cpuusage.h"
+
+enum { PATTERN_CHURN, PATTERN_XFER, PATTERN_MIX };
+enum { ALLOC_MALLOC, ALLOC_POOL };
+
+/* Modifiable via command line */
+char *pattern_name = "churn";
+int nr_threads = 4;
+int duration = 5;
+char *allocator_name = "malloc";
+int obj_size = 64;
+int batch = 256;
+int human = 1;
+int preempt_period = PREEMPT_PERIOD;
+
+static int pattern;
+static int allocator;
+
+/* Pool objects carry a 16 byte header with their size class, so a thread can
+ * free an object into its own free lists no matter who allocated it.  Classes
+ * are powers of two from 32 bytes to 64KB, header included; anything bigger
+ * goes straight to malloc. */
+#define POOL_HDR 16
+#define POOL_MIN_SHIFT 5
+#define POOL_CLASSES 12
+#define POOL_CHUNK (1024 * 1024)
+#define POOL_BIG (-1L)
+
+struct pool_obj {
+	struct pool_obj *next;
+};
+
+struct pool {
+	struct pool_obj *free[POOL_CLASSES];
+	char *chunk;
+	size_t left;
+};
+
+/* Objects sent to a thread by the xfer pattern, linked through their first
+ * word.  Senders push whole chains and the owner takes the lot with an xchg,
+ * so there's no ABA to worry about. */
+struct inbox {
+	void *volatile head;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct tdata {
+	uint64_t ops;
+	uint64_t stalls;   /* xfer: times the next inbox was still full */
+	uint64_t rng;
+	struct pool pool;
+	void **objs;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct tdata *tdata;
+static struct inbox *inboxes;
+static struct tree_barrier barrier;
+static uint64_t start_tsc, end_tsc, stop_tsc;
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static inline int pool_class(size_t size)
+{
+	size += POOL_HDR;
+	if (size <= (1 << POOL_MIN_SHIFT))
+		return 0;
+	int c = 64 - __builtin_clzl(size - 1) - POOL_MIN_SHIFT;
+	return c < POOL_CLASSES ? c : -1;
+}
+
+static void *pool_alloc(struct pool *p, size_t size)
+{
+	long *hdr;
+	int c = pool_class(size);
+	if (c < 0) {
+		hdr = malloc(size + POOL_HDR);
+		*hdr = POOL_BIG;
+		return (char*)hdr + POOL_HDR;
+	}
+	if (p->free[c]) {
+		hdr = (long*)p->free[c];
+		p->free[c] = p->free[c]->next;
+	} else {
+		size_t csize = 1UL << (c + POOL_MIN_SHIFT);
+		/* Whatever's left of the old chunk is just dropped. */
+		if (p->left < csize) {
+			p->chunk = malloc(POOL_CHUNK);
+			p->left = POOL_CHUNK;
+		}
+		hdr = (long*)p->chunk;
+		p->chunk += csize;
+		p->left -= csize;
+	}
+	*hdr = c;
+	return (char*)hdr + POOL_HDR;
+}
+
+static void pool_free(struct pool *p, void *ptr)
+{
+	long *hdr = (long*)((char*)ptr - POOL_HDR);
+	long c = *hdr;
+	if (c == POOL_BIG) {
+		free(hdr);
+		return;
+	}
+	/* The free list link overwrites the header. */
+	struct pool_obj *o = (struct pool_obj*)hdr;
+	o->next = p->free[c];
+	p->free[c] = o;
+}
+
+static inline void *bench_alloc(struct tdata *t, size_t size)
+{
+	void *p;
+	if (allocator == ALLOC_POOL)
+		p = pool_alloc(&t->pool, size);
+	else
+		p = malloc(size);
+	/* Touch it, so the pages really get faulted in. */
+	*(volatile char*)p = 0;
+	return p;
+}
+
+static inline void bench_free(struct tdata *t, void *p)
+{
+	if (allocator == ALLOC_POOL)
+		pool_free(&t->pool, p);
+	else
+		free(p);
+}
+
+/* Mostly small objects, with a long tail: 70% up to 128 bytes, 25% up to 1KB,
+ * 4% up to 8KB and 1% up to 32KB. */
+static inline size_t mix_size(struct tdata *t)
+{
+	uint64_t r = xorshift(&t->rng);
+	int pct = r % 100;
+	r >>= 8;
+	if (pct < 70)
+		return 16 + r % (128 - 16);
+	if (pct < 95)
+		return 128 + r % (1024 - 128);
+	if (pct < 99)
+		return 1024 + r % (8192 - 1024);
+	return 8192 + r % (32768 - 8192);
+}
+
+static void drain_inbox(struct tdata *t, struct inbox *in)
+{
+	void *p = __sync_lock_test_and_set(&in->head, NULL);
+	while (p) {
+		void *next = *(void**)p;
+		bench_free(t, p);
+		p = next;
+	}
+}
+
+static void run_churn(struct tdata *t)
+{
+	for (int i = 0; i < batch; i++)
+		t->objs[i] = bench_alloc(t, obj_size);
+	for (int i = 0; i < batch; i++)
+		bench_free(t, t->objs[i]);
+	t->ops += batch;
+}
+
+static void run_xfer(struct tdata *t, int id)
+{
+	struct inbox *to = &inboxes[(id + 1) % nr_threads];
+	void *head = NULL, *tail = NULL;
+
+	/* We're the only sender to this inbox, so once it's empty it stays
+	 * that way until we fill it. */
+	if (to->head) {
+		t->stalls++;
+		drain_inbox(t, &inboxes[id]);
+		pthread_yield();
+		return;
+	}
+	for (int i = 0; i < batch; i++) {
+		void *p = bench_alloc(t, MAX(obj_size, sizeof(void*)));
+		*(void**)p = head;
+		head = p;
+		if (!tail)
+			tail = p;
+	}
+	void *old;
+	do {
+		old = to->head;
+		*(void**)tail = old;
+	} while (!__sync_bool_compare_and_swap(&to->head, old, head));
+	drain_inbox(t, &inboxes[id]);
+	t->ops += batch;
+}
+
+static void run_mix(struct tdata *t)
+{
+	for (int i = 0; i < batch; i++) {
+		int slot = xorshift(&t->rng) % batch;
+		bench_free(t, t->objs[slot]);
+		t->objs[slot] = bench_alloc(t, mix_size(t));
+	}
+	t->ops += batch;
+}
+
+static void *alloc_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct tdata *t = &tdata[id];
+
+	/* The vcore scheduler decides where upthreads run. */
+#ifdef USE_PTHREAD
+	pin_to_core(placement_cpu(id));
+#endif
+	t->rng = 0x9e3779b97f4a7c15ULL * (id + 1);
+	t->objs = calloc(batch, sizeof(void*));
+	if (pattern == PATTERN_MIX)
+		for (int i = 0; i < batch; i++)
+			t->objs[i] = bench_alloc(t, mix_size(t));
+
+	tree_barrier_wait(&barrier, id + 1);
+	while (read_tsc() < end_tsc) {
+		switch (pattern) {
+			case PATTERN_CHURN:
+				run_churn(t);
+				break;
+			case PATTERN_XFER:
+				run_xfer(t, id);
+				break;
+			case PATTERN_MIX:
+				run_mix(t);
+				break;
+		}
+		#ifdef WITH_YIELD
+		pthread_yield();
+		#endif
+	}
+
+	/* Wait until nobody can send us anything else, and sample the resident
+	 * set before we start giving memory back. */
+	tree_barrier_wait(&barrier, id + 1);
+	if (pattern == PATTERN_XFER)
+		drain_inbox(t, &inboxes[id]);
+	if (pattern == PATTERN_MIX)
+		for (int i = 0; i < batch; i++)
+			bench_free(t, t->objs[i]);
+	free(t->objs);
+	return NULL;
+}
+
+/* Resident set size in KB. */
+static uint64_t rss_kb(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	if (argc > 1)
+		pattern_name = argv[1];
+	if (argc > 2)
+		nr_threads = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		duration = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		allocator_name = argv[4];
+	if (argc > 5)
+		obj_size = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		batch = strtol(argv[6], 0, 10);
+	if (argc > 7)
+		human = strtol(argv[7], 0, 10);
+	if (argc > 8)
+		preempt_period = strtol(argv[8], 0, 10);
+
+	if (!strcmp(pattern_name, "churn"))
+		pattern = PATTERN_CHURN;
+	else if (!strcmp(pattern_name, "xfer"))
+		pattern = PATTERN_XFER;
+	else if (!strcmp(pattern_name, "mix"))
+		pattern = PATTERN_MIX;
+	else {
+		fprintf(stderr, "Unknown pattern: %s\n", pattern_name);
+		exit(1);
+	}
+	if (!strcmp(allocator_name, "malloc"))
+		allocator = ALLOC_MALLOC;
+	else if (!strcmp(allocator_name, "pool"))
+		allocator = ALLOC_POOL;
+	else {
+		fprintf(stderr, "Unknown allocator: %s\n", allocator_name);
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	topology_init();
+	results_init("alloc", argc, argv);
+
+	pthread_t *thandles = calloc(nr_threads, sizeof(pthread_t));
+	tdata = aligned_alloc(ARCH_CL_SIZE, sizeof(struct tdata) * nr_threads);
+	memset(tdata, 0, sizeof(struct tdata) * nr_threads);
+	inboxes = aligned_alloc(ARCH_CL_SIZE, sizeof(struct inbox) * nr_threads);
+	memset(inboxes, 0, sizeof(struct inbox) * nr_threads);
+
+	/* Do any library specific test prep */
+	test_prep();
+	tree_barrier_init(&barrier, nr_threads + 1,
+	                  TREE_BARRIER_YIELD | TREE_BARRIER_GATED);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&thandles[i], NULL, alloc_thread, (void*)(long)i);
+
+	struct cpu_usage usage;
+	tree_barrier_gather(&barrier, 0);
+	uint64_t rss_start = rss_kb();
+	cpu_usage_begin(&usage);
+	start_tsc = read_tsc();
+	end_tsc = start_tsc + sec2tsc(duration);
+	tree_barrier_release(&barrier);
+
+	tree_barrier_gather(&barrier, 0);
+	stop_tsc = read_tsc();
+	cpu_usage_end(&usage);
+	uint64_t rss_end = rss_kb();
+	tree_barrier_release(&barrier);
+
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(thandles[i], NULL);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	uint64_t ops = 0, stalls = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		ops += tdata[i].ops;
+		stalls += tdata[i].stalls;
+	}
+	uint64_t ops_per_sec = ops * get_tsc_freq() / (stop_tsc - start_tsc);
+	int64_t growth = rss_end - rss_start;
+
+	if (human) {
+		printf("%s pattern with %s: %d threads, obj_size: %d, batch: %d\n",
+		       pattern_name, allocator_name, nr_threads, obj_size, batch);
+		printf("  ops/s:        %ld (%ld per thread)\n", ops_per_sec,
+		       ops_per_sec / nr_threads);
+		printf("  rss:          %ldKB -> %ldKB (%+ldKB, %+ldKB per thread)\n",
+		       rss_start, rss_end, growth, growth / nr_threads);
+		printf("  max rss:      %ldKB\n", ru.ru_maxrss);
+		print_cpu_usage(stdout, &usage, ops, tree_barrier_spins(&barrier));
+	} else {
+		printf("%s:%s:%d:%d:%d:%ld:%ld:%ld:%ld:%ld:%ld:%ld\n",
+		       pattern_name, allocator_name, nr_threads, obj_size, batch,
+		       get_tsc_freq(), start_tsc, stop_tsc, ops, rss_start, rss_end,
+		       ru.ru_maxrss);
+	}
+
+	struct result r;
+	result_begin(&r, pattern_name);
+	result_param_str(&r, "allocator", allocator_name);
+	result_param_int(&r, "nr_threads", nr_threads);
+	result_param_int(&r, "duration", duration);
+	result_param_int(&r, "obj_size", obj_size);
+	result_param_int(&r, "batch", batch);
+	result_param_int(&r, "preempt_period", preempt_period);
+	result_param_str(&r, "placement", topology.policy);
+	result_metric_int(&r, "tsc_freq", get_tsc_freq());
+	result_metric_int(&r, "beg", start_tsc);
+	result_metric_int(&r, "end", stop_tsc);
+	result_metric_int(&r, "count", ops);
+	result_metric_int(&r, "rss_start_kb", rss_start);
+	result_metric_int(&r, "rss_end_kb", rss_end);
+	result_metric_int(&r, "rss_growth_per_thread_kb", growth / nr_threads);
+	result_metric_int(&r, "maxrss_kb", ru.ru_maxrss);
+	if (pattern == PATTERN_XFER)
+		result_metric_int(&r, "xfer_stalls", stalls);
+	result_cpu_usage(&r, &usage, ops, tree_barrier_spins(&barrier));
+	result_end(&r);
+	return 0;
+}
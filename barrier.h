@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* A combining tree barrier for starting benchmarks.  Threads arrive at a leaf
+ * shared with at most TREE_BARRIER_FANIN - 1 others, and only the last one in
+ * at each node moves on to its parent, so no single counter gets hammered by
+ * every thread.  The last one in at the root bumps a generation number that
+ * everyone else waits on, which also makes the barrier reusable.
+ *
+ * With TREE_BARRIER_YIELD, waiters call pthread_yield() instead of spinning,
+ * which is needed whenever there are more threads than cores (and with
+ * upthreads, whenever more than one thread shares a vcore).  Include this
+ * after libconfig.h so pthread_yield() maps to the right library.
+ *
+ * With TREE_BARRIER_GATED, the last thread in doesn't release anyone.
+ * Instead, a controlling thread calls tree_barrier_gather() to wait for
+ * everyone, does whatever it needs to (set an alarm, take a timestamp), and
+ * then calls tree_barrier_release().
+ *
+ * Waiters count how many times they spun (or yielded) at their leaf, and
+ * tree_barrier_spins() adds them up, so benchmarks can report cycles burned
+ * waiting next to the work they got done. */
+
+#ifndef BENCHMARKS_BARRIER_H
+#define BENCHMARKS_BARRIER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/param.h> /* MIN */
+#include <parlib/arch.h>
+
+#ifndef TREE_BARRIER_FANIN
+#define TREE_BARRIER_FANIN 4
+#endif
+
+#define TREE_BARRIER_YIELD (1 << 0)
+#define TREE_BARRIER_GATED (1 << 1)
+
+struct tree_barrier_node {
+	int count;
+	int nr_children;
+	struct tree_barrier_node *parent;
+	uint64_t spins;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct tree_barrier {
+	volatile int gen __attribute__((aligned(ARCH_CL_SIZE)));
+	volatile int gathered;
+	int nr_threads;
+	int nr_nodes;
+	int flags;
+	struct tree_barrier_node *nodes;
+};
+
+static inline void tree_barrier_init(struct tree_barrier *b, int nr_threads,
+                                     int flags)
+{
+	int nr_nodes = 0;
+	/* With no threads there's no root, and the levels never end. */
+	if (nr_threads < 1) {
+		fprintf(stderr, "tree_barrier_init: need at least one thread, "
+		                "got %d\n", nr_threads);
+		exit(1);
+	}
+	for (int n = nr_threads; ; n = (n + TREE_BARRIER_FANIN - 1)
+	                                / TREE_BARRIER_FANIN) {
+		nr_nodes += (n + TREE_BARRIER_FANIN - 1) / TREE_BARRIER_FANIN;
+		if (n <= TREE_BARRIER_FANIN)
+			break;
+	}
+
+	b->gen = 0;
+	b->gathered = 0;
+	b->nr_threads = nr_threads;
+	b->nr_nodes = nr_nodes;
+	b->flags = flags;
+	b->nodes = aligned_alloc(ARCH_CL_SIZE,
+	                         sizeof(struct tree_barrier_node) * nr_nodes);
+
+	/* Lay the tree out level by level, leaves first.  Node i of a level
+	 * covers children [i*FANIN, (i+1)*FANIN) of the level below it. */
+	struct tree_barrier_node *level = b->nodes;
+	int nr_below = nr_threads;
+	while (1) {
+		int nr_level = (nr_below + TREE_BARRIER_FANIN - 1)
+		               / TREE_BARRIER_FANIN;
+		struct tree_barrier_node *next = level + nr_level;
+		for (int i = 0; i < nr_level; i++) {
+			level[i].count = 0;
+			level[i].spins = 0;
+			level[i].nr_children = MIN(TREE_BARRIER_FANIN,
+			                           nr_below - i * TREE_BARRIER_FANIN);
+			level[i].parent = nr_level > 1 ? &next[i / TREE_BARRIER_FANIN]
+			                               : NULL;
+		}
+		if (nr_level == 1)
+			break;
+		level = next;
+		nr_below = nr_level;
+	}
+}
+
+static inline void tree_barrier_destroy(struct tree_barrier *b)
+{
+	free(b->nodes);
+	b->nodes = NULL;
+}
+
+/* Returns true if we were the last thread to arrive. */
+static inline bool __tree_barrier_arrive(struct tree_barrier *b, int id)
+{
+	struct tree_barrier_node *node = &b->nodes[id / TREE_BARRIER_FANIN];
+	while (node) {
+		if (__sync_add_and_fetch(&node->count, 1) < node->nr_children)
+			return false;
+		/* Everyone below us is in, so nobody else touches this node until
+		 * the next generation. */
+		node->count = 0;
+		node = node->parent;
+	}
+	return true;
+}
+
+static inline void __tree_barrier_spin(struct tree_barrier *b, int id,
+                                       volatile int *var, int val)
+{
+	uint64_t spins = 0;
+	while (*var == val) {
+		if (b->flags & TREE_BARRIER_YIELD)
+			pthread_yield();
+		else
+			cpu_relax();
+		spins++;
+	}
+	if (spins)
+		__sync_fetch_and_add(&b->nodes[id / TREE_BARRIER_FANIN].spins, spins);
+}
+
+/* Spins by all waiters since tree_barrier_init(). */
+static inline uint64_t tree_barrier_spins(struct tree_barrier *b)
+{
+	uint64_t spins = 0;
+	for (int i = 0; i < b->nr_nodes; i++)
+		spins += b->nodes[i].spins;
+	return spins;
+}
+
+/* Arrive as thread 'id' (0 <= id < nr_threads) and wait to be released. */
+static inline void tree_barrier_wait(struct tree_barrier *b, int id)
+{
+	int gen = b->gen;
+	cmb();
+	if (__tree_barrier_arrive(b, id)) {
+		if (!(b->flags & TREE_BARRIER_GATED)) {
+			__sync_fetch_and_add(&b->gen, 1);
+			return;
+		}
+		b->gathered = 1;
+	}
+	__tree_barrier_spin(b, id, &b->gen, gen);
+}
+
+/* Arrive as thread 'id' and wait for everyone else to arrive, without
+ * releasing them.  Only for TREE_BARRIER_GATED barriers. */
+static inline void tree_barrier_gather(struct tree_barrier *b, int id)
+{
+	if (__tree_barrier_arrive(b, id))
+		b->gathered = 1;
+	__tree_barrier_spin(b, id, &b->gathered, 0);
+}
+
+/* Release everyone after a tree_barrier_gather(). */
+static inline void tree_barrier_release(struct tree_barrier *b)
+{
+	b->gathered = 0;
+	__sync_fetch_and_add(&b->gen, 1);
+}
+
+#endif /* BENCHMARKS_BARRIER_H */
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* How much cpu a measurement burned, next to how much work it got done.
+ * Throughput alone hides a library whose idle vcores or barrier waiters spin
+ * away whole cores, so the benchmarks also take the process's user and
+ * system time and context switches from getrusage() over the measured
+ * window, and report ops per cpu-second:
+ *
+ *   struct cpu_usage u;
+ *   cpu_usage_begin(&u);
+ *   ... run the test ...
+ *   cpu_usage_end(&u);
+ *   result_cpu_usage(&r, &u, count, tree_barrier_spins(&barrier));
+ *
+ * Vcores are kernel threads of the process, so their time (spinning or not)
+ * is in here for upthreads too.  'spins' is whatever idle spinning the
+ * benchmark can count itself, like waits in its barriers. */
+
+#ifndef BENCHMARKS_CPUUSAGE_H
+#define BENCHMARKS_CPUUSAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "results.h"
+
+struct cpu_usage {
+	uint64_t wall;      /* tsc ticks */
+	uint64_t user_us;
+	uint64_t sys_us;
+	long nvcsw;         /* voluntary context switches */
+	long nivcsw;        /* involuntary context switches */
+};
+
+static inline uint64_t __timeval_usec(struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+static void cpu_usage_begin(struct cpu_usage *u)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	u->user_us = __timeval_usec(&ru.ru_utime);
+	u->sys_us = __timeval_usec(&ru.ru_stime);
+	u->nvcsw = ru.ru_nvcsw;
+	u->nivcsw = ru.ru_nivcsw;
+	u->wall = read_tsc();
+}
+
+/* Turn the snapshot from cpu_usage_begin() into what was used since. */
+static void cpu_usage_end(struct cpu_usage *u)
+{
+	struct rusage ru;
+	u->wall = read_tsc() - u->wall;
+	getrusage(RUSAGE_SELF, &ru);
+	u->user_us = __timeval_usec(&ru.ru_utime) - u->user_us;
+	u->sys_us = __timeval_usec(&ru.ru_stime) - u->sys_us;
+	u->nvcsw = ru.ru_nvcsw - u->nvcsw;
+	u->nivcsw = ru.ru_nivcsw - u->nivcsw;
+}
+
+static inline double cpu_usage_secs(struct cpu_usage *u)
+{
+	return (u->user_us + u->sys_us) / 1e6;
+}
+
+/* Cpus kept busy on average over the window. */
+static inline double cpu_usage_util(struct cpu_usage *u)
+{
+	return u->wall ? cpu_usage_secs(u) * get_tsc_freq() / u->wall : 0;
+}
+
+static inline double cpu_usage_ops_per_cpu_sec(struct cpu_usage *u,
+                                               uint64_t ops)
+{
+	double secs = cpu_usage_secs(u);
+	return secs > 0 ? ops / secs : 0;
+}
+
+static void result_cpu_usage(struct result *r, struct cpu_usage *u,
+                             uint64_t ops, uint64_t spins)
+{
+	result_metric_int(r, "user_us", u->user_us);
+	result_metric_int(r, "sys_us", u->sys_us);
+	result_metric_double(r, "cpus_busy", cpu_usage_util(u));
+	result_metric_int(r, "vol_ctxsw", u->nvcsw);
+	result_metric_int(r, "invol_ctxsw", u->nivcsw);
+	result_metric_int(r, "idle_spins", spins);
+	result_metric_double(r, "ops_per_cpu_s",
+	                     cpu_usage_ops_per_cpu_sec(u, ops));
+}
+
+static void print_cpu_usage(FILE *f, struct cpu_usage *u, uint64_t ops,
+                            uint64_t spins)
+{
+	fprintf(f, "  cpu: user %.3fs, sys %.3fs (%.2f cpus busy), "
+	        "ctxsw %ld voluntary %ld involuntary, %ld idle spins, "
+	        "%.0f ops/cpu-s\n", u->user_us / 1e6, u->sys_us / 1e6,
+	        cpu_usage_util(u), u->nvcsw, u->nivcsw, spins,
+	        cpu_usage_ops_per_cpu_sec(u, ops));
+}
+
+#endif /* BENCHMARKS_CPUUSAGE_H */
@@ -10,6 +10,7 @@
 #include <sys/prctl.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sched.h>
 #include <limits.h>
 #include <sys/sysinfo.h>
@@ -18,17 +19,49 @@
 #include <parlib/arch.h>
 #include <parlib/atomic.h>
 #include "../libconfig.h"
+#include "../barrier.h"
+#include "../topology.h"
+#include "../results.h"
+#include "../jitter.h"
+#include "../cpuusage.h"
 
-void pin_to_core(int core)
+void print_header(char *name, int ncpus, int tpc, int time, bool human)
+{
+	if (human)
+		printf("%s tests: ncpus: %d, tpc: %d, duration: %ds\n",
+		       name, ncpus, tpc, time);
+	else
+		printf("%s:%d:%d:%d\n", name, ncpus, tpc, time);
+}
+
+/* Parse a list like "1,2,4,8" or a range like "1-32" (or a mix of the two)
+ * into a newly allocated array, returning the number of entries. */
+int parse_list(char *spec, int **vals)
 {
-	cpu_set_t c;                                                                           
-	CPU_ZERO(&c);
-	CPU_SET(core, &c);
-	sched_setaffinity(0, sizeof(cpu_set_t), &c);
-	sched_yield();                                                                         
+	int n = 0;
+	char *s = strdup(spec);
+	*vals = NULL;
+	for (char *tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		char *end;
+		int lo = strtol(tok, &end, 10);
+		int hi = *end == '-' ? strtol(end + 1, 0, 10) : lo;
+		if (hi < lo) {
+			fprintf(stderr, "Bad range: %s\n", tok);
+			exit(1);
+		}
+		*vals = realloc(*vals, sizeof(int) * (n + hi - lo + 1));
+		for (int i = lo; i <= hi; i++)
+			(*vals)[n++] = i;
+	}
+	free(s);
+	return n;
 }
 
-void multi_core_tests(int ncpus, int tpc, int time, bool human)
+/* Run the test for every (ncpus, tpc) pair in the two lists, in the same
+ * process, so the per-core tsc calibration and process startup are only paid
+ * once for the whole sweep.  Returns how many of them were noisy. */
+int multi_core_tests(int *ncpus_list, int nr_ncpus, int *tpc_list,
+                      int nr_tpcs, int time, bool human)
 {
 	struct tdata {
 		uint64_t tsc_freq;
@@ -38,15 +71,89 @@ void multi_core_tests(int ncpus, int tpc, int time, bool human)
 		bool stop;
 		bool done;
 		uint64_t count;
+		int cpu;
 	} __attribute__((aligned(ARCH_CL_SIZE)));
 
-	static int barrier;
-	static void (*run_loop)(int);
+	/* Threads sharing a core each count on their own line. */
+	struct tcount {
+		uint64_t count;
+		int core;
+	} __attribute__((aligned(ARCH_CL_SIZE)));
+
+	struct fairness {
+		uint64_t min;
+		uint64_t max;
+		double jain;
+	};
+
+	static struct tree_barrier barrier;
 	static char *run_prefix;
-	static pthread_t thread;
-	static struct tdata *tdata;
+	static pthread_t *threads;
+	static struct tdata **tdata;
+	static struct tcount *tcounts;
 	static bool test_done;
-	tdata = aligned_alloc(PGSIZE, sizeof(struct tdata) * ncpus);
+	static struct cpu_usage usage;
+	int ncpus = 0, tpc = 0;
+	int nr_vcores = 1;
+	int nr_noisy = 0;
+
+	/* Size everything for the biggest point in the sweep. */
+	int max_ncpus = 0, max_tpc = 0;
+	for (int i = 0; i < nr_ncpus; i++)
+		max_ncpus = MAX(max_ncpus, ncpus_list[i]);
+	for (int i = 0; i < nr_tpcs; i++)
+		max_tpc = MAX(max_tpc, tpc_list[i]);
+	/* Each core's data lives on that core's node. */
+	tdata = malloc(sizeof(struct tdata*) * max_ncpus);
+	for (int i = 0; i < max_ncpus; i++)
+		tdata[i] = node_alloc(sizeof(struct tdata),
+		                      cpu_node(placement_cpu(i)));
+	threads = calloc(max_ncpus * max_tpc, sizeof(pthread_t));
+	tcounts = aligned_alloc(ARCH_CL_SIZE,
+	                        sizeof(struct tcount) * max_ncpus * max_tpc);
+
+	/* Jain's index and the spread of the per-thread counts on 'core', or
+	 * across every thread if core < 0. */
+	void fairness(int core, struct fairness *f)
+	{
+		double sum = 0, sumsq = 0;
+		int n = 0;
+		f->min = UINT64_MAX;
+		f->max = 0;
+		for (int i = 0; i < ncpus * tpc; i++) {
+			if (core >= 0 && tcounts[i].core != core)
+				continue;
+			double c = tcounts[i].count;
+			sum += c;
+			sumsq += c * c;
+			f->min = MIN(f->min, tcounts[i].count);
+			f->max = MAX(f->max, tcounts[i].count);
+			n++;
+		}
+		if (!n)
+			f->min = 0;
+		f->jain = sumsq > 0 ? sum * sum / (n * sumsq) : 1;
+	}
+
+	void print_fairness(char *what, struct fairness *f)
+	{
+		printf("    %s fairness: %.4f, max/min: ", what, f->jain);
+		if (f->min)
+			printf("%.2f", (double)f->max / f->min);
+		else
+			printf("inf");
+		printf(" (%ld - %ld)\n", f->min, f->max);
+	}
+
+	void result_fairness(struct result *r, struct fairness *f)
+	{
+		result_metric_double(r, "jain", f->jain);
+		result_metric_int(r, "min_thread_count", f->min);
+		result_metric_int(r, "max_thread_count", f->max);
+		if (f->min)
+			result_metric_double(r, "max_min_ratio",
+			                     (double)f->max / f->min);
+	}
 
 	void dump_results(char *prefix, bool human)
 	{
@@ -54,104 +161,176 @@ void multi_core_tests(int ncpus, int tpc, int time, bool human)
 			uint64_t tcount = 0;
 			uint64_t max_end_time = 0;
 			uint64_t min_beg_time = LONG_MAX;
+			struct fairness f;
 			printf("Multicore %s test:\n", prefix);
+			print_topology(stdout, ncpus);
 			for (int i=0; i<ncpus; i++) {
-				printf("  Core %2d: ", i);
+				printf("  Core %2d (cpu %2d, node %d): ", i, tdata[i]->cpu,
+				       cpu_node(tdata[i]->cpu));
 				printf("    ops/s: %ld",
-				         tdata[i].count/tsc2msec(tdata[i].end_time 
-						                         - tdata[i].beg_time) * 1000);
+				         tdata[i]->count/tsc2msec(tdata[i]->end_time 
+						                         - tdata[i]->beg_time) * 1000);
 				printf("    latency: %ldns\n",
-				         tsc2nsec(tdata[i].end_time - tdata[i].beg_time)
-						 / tdata[i].count);
-				tcount += tdata[i].count;
-				max_end_time = MAX(max_end_time, tdata[i].end_time);
-				min_beg_time = MIN(min_beg_time, tdata[i].beg_time);
+				         tsc2nsec(tdata[i]->end_time - tdata[i]->beg_time)
+						 / tdata[i]->count);
+				if (tpc > 1) {
+					fairness(i, &f);
+					print_fairness("thread", &f);
+				}
+				tcount += tdata[i]->count;
+				max_end_time = MAX(max_end_time, tdata[i]->end_time);
+				min_beg_time = MIN(min_beg_time, tdata[i]->beg_time);
 			}
 			printf("  Total  : ");
 			printf("    ops/s: %ld",
 			         tcount/tsc2msec(max_end_time - min_beg_time) * 1000);
 			printf("   latency: %ldns\n",
 			         tsc2nsec(max_end_time - min_beg_time)/tcount);
+			fairness(-1, &f);
+			print_fairness("global", &f);
+			print_cpu_usage(stdout, &usage, tcount,
+			                tree_barrier_spins(&barrier));
 		} else {
+			/* The per-thread spread goes on the end, where the graphing
+			 * scripts won't notice it. */
+			for (int i=0; i<ncpus; i++) {
+				struct fairness f;
+				fairness(i, &f);
+				printf("%d:%ld:%ld:%ld:%ld:%d:%d:%ld:%ld:%.4f\n", i,
+				       tdata[i]->tsc_freq, tdata[i]->beg_time,
+				       tdata[i]->end_time, tdata[i]->count, tdata[i]->cpu,
+				       cpu_node(tdata[i]->cpu), f.min, f.max, f.jain);
+			}
+		}
+		for (int i=0; i<ncpus && results_enabled(); i++) {
+			struct result r;
+			result_begin(&r, prefix);
+			result_param_int(&r, "ncpus", ncpus);
+			result_param_int(&r, "tpc", tpc);
+			result_param_int(&r, "time", time);
+			result_param_str(&r, "placement", topology.policy);
+			result_param_int(&r, "core", i);
+			result_param_int(&r, "cpu", tdata[i]->cpu);
+			result_param_int(&r, "node", cpu_node(tdata[i]->cpu));
+			result_metric_int(&r, "tsc_freq", tdata[i]->tsc_freq);
+			result_metric_int(&r, "beg", tdata[i]->beg_time);
+			result_metric_int(&r, "end", tdata[i]->end_time);
+			result_metric_int(&r, "count", tdata[i]->count);
+			if (tpc > 1) {
+				struct fairness f;
+				fairness(i, &f);
+				result_fairness(&r, &f);
+			}
+			result_end(&r);
+		}
+		for (int i=0; i<ncpus * tpc && results_enabled(); i++) {
+			struct result r;
+			result_begin(&r, "thread");
+			result_param_int(&r, "ncpus", ncpus);
+			result_param_int(&r, "tpc", tpc);
+			result_param_int(&r, "time", time);
+			result_param_str(&r, "placement", topology.policy);
+			result_param_int(&r, "core", tcounts[i].core);
+			result_param_int(&r, "thread", i);
+			result_metric_int(&r, "count", tcounts[i].count);
+			result_end(&r);
+		}
+		/* Cpu time is only known for the whole process. */
+		if (results_enabled()) {
+			uint64_t tcount = 0;
 			for (int i=0; i<ncpus; i++)
-				printf("%d:%ld:%ld:%ld:%ld\n", i, tdata[i].tsc_freq,
-				       tdata[i].beg_time, tdata[i].end_time, tdata[i].count);
+				tcount += tdata[i]->count;
+			struct result r;
+			struct fairness f;
+			fairness(-1, &f);
+			result_begin(&r, "cpu");
+			result_param_int(&r, "ncpus", ncpus);
+			result_param_int(&r, "tpc", tpc);
+			result_param_int(&r, "time", time);
+			result_param_str(&r, "placement", topology.policy);
+			result_metric_int(&r, "tsc_freq", get_tsc_freq());
+			result_metric_int(&r, "count", tcount);
+			result_cpu_usage(&r, &usage, tcount,
+			                 tree_barrier_spins(&barrier));
+			result_fairness(&r, &f);
+			result_end(&r);
 		}
 	}
 
 	void alarm_handler(int sig)
 	{
-		tdata[0].stop = true;
+		tdata[0]->stop = true;
 	}
 
-	void yieldloop(int id) {
+	void yieldloop(int tid, int id) {
 		/* Pull these out to optimize the loop. */
-		volatile bool *stop = &tdata[id].stop;
-		uint64_t *count = &tdata[id].count;
+		volatile bool *stop = &tdata[id]->stop;
+		uint64_t count = 0;
 
-		/* If we are the first oe in on this core, set the beg time. */
-		if (!tdata[id].beg_time) {
-			tdata[id].beg_time = read_tsc();
-		}
+		/* If we are the first one in on this core, set the beg time. */
+		__sync_bool_compare_and_swap(&tdata[id]->beg_time, 0, read_tsc());
 
-		/* Do the loop */
+		/* Do the loop.  The count stays in a register, since with native
+		 * pthreads the threads on a core can preempt each other. */
 		while (!*stop) {
 			pthread_yield();
-			(*count)++;
+			count++;
 		}
+		tcounts[tid].count = count;
+		tcounts[tid].core = id;
 
 		/* If we are the first one out on this core, set the end time. */
-		if (!tdata[id].end_time) {
-			tdata[id].end_time = read_tsc();
-			tdata[id].done = true;
-		}
+		if (__sync_bool_compare_and_swap(&tdata[id]->end_time, 0, read_tsc()))
+			tdata[id]->done = true;
 	}
 
 	void *thread_handler(void *arg)
 	{
+		/* Every thread has its own slot in the barrier, and threads are
+		 * numbered so that tid % ncpus is the core they belong on. */
+		int tid = (int)(long)arg;
 #ifdef USE_PTHREAD
-		int id = (int)(long)arg;
-		pin_to_core(id);
+		int id = tid % ncpus;
+		pin_to_core(placement_cpu(id));
 #else
 		int id = vcore_id();
 #endif
 
-		/* When barrier == ncpus, we coming in from the main thread, so skip
-		 * all this work that we will have already done. */
-		if (barrier != ncpus) {
+		/* When tid == 0, we coming in from the main thread, so skip all this
+		 * work that we will have already done. */
+		if (tid != 0) {
 
 			/* If we are the first thread on this core. */
-			if (atomic_cas(&tdata[id].start, 0, 1)) {
+			if (atomic_cas(&tdata[id]->start, 0, 1)) {
 				/* Get this core's tsc_frequency. */
-				tdata[id].tsc_freq = get_tsc_freq();
-				/* Up the barrier. */
-				__sync_fetch_and_add(&barrier, 1);
+				tdata[id]->tsc_freq = get_tsc_freq();
+				tdata[id]->cpu = sched_getcpu();
 			}
 
-			/* Checkin and barrier waiting for all cpus to come up. */
-			while (barrier < ncpus)
-				cmb();
+			/* Checkin and barrier waiting for all threads to come up. */
+			tree_barrier_wait(&barrier, tid);
 		}
 
-		/* Run the loop. */
-		run_loop(id);
+		/* Run the loop.  Called directly, not through a pointer, so it can
+		 * be inlined here. */
+		yieldloop(tid, id);
 	}
 
-	void run_test(char *prefix, int time, void (*test_func)(int))
+	void run_test(char *prefix, int time)
 	{
 		/* Set up the globals for the test */
 		run_prefix = prefix;
-		run_loop = test_func;
-		barrier = 0;
 		test_done = false;
+		memset(tcounts, 0, sizeof(struct tcount) * ncpus * tpc);
 		for (int i=0; i<ncpus; i++) {
-			tdata[i].tsc_freq = 0;
-			tdata[i].beg_time = 0;
-			tdata[i].end_time = 0;
-			tdata[i].start = ATOMIC_INITIALIZER(0);
-			tdata[i].stop = 0;
-			tdata[i].done = 0;
-			tdata[i].count = 0;
+			tdata[i]->tsc_freq = 0;
+			tdata[i]->beg_time = 0;
+			tdata[i]->end_time = 0;
+			tdata[i]->start = ATOMIC_INITIALIZER(0);
+			tdata[i]->stop = 0;
+			tdata[i]->done = 0;
+			tdata[i]->count = 0;
+			tdata[i]->cpu = -1;
 		}
 
 #ifndef USE_PTHREAD
@@ -161,32 +340,41 @@ void multi_core_tests(int ncpus, int tpc, int time, bool human)
 		upthread_set_num_vcores(ncpus);
 #endif
 
-		/* Spawn off 1 thread per core except for core 0. */
-		int i = 0, j = 1;
-		for (i; i< tpc; i++) {
-			for (j; j < ncpus; j++)
-				pthread_create(&thread, NULL, thread_handler, (void*)(long)j);
-			j=0;
+		/* Threads sharing a core have to yield to each other while they wait,
+		 * but one thread per core can just spin. */
+		tree_barrier_init(&barrier, ncpus * tpc, TREE_BARRIER_GATED
+		                  | (tpc > 1 ? TREE_BARRIER_YIELD : 0));
+
+		/* Spawn off tpc threads per core, except for one on core 0. */
+		for (int i = 1; i < ncpus * tpc; i++)
+			pthread_create(&threads[i], NULL, thread_handler, (void*)(long)i);
+
+		/* Wait until now to do our vcore request.  Vcores are never given
+		 * back between points, so only ask for the ones we don't have yet
+		 * (see the sweep order below). */
+		if (ncpus > nr_vcores) {
+			vcore_request(ncpus - nr_vcores);
+			nr_vcores = ncpus;
 		}
-		
-		/* Wait until now to do our vcore request */
-		vcore_request(ncpus - 1);
 
 		/* Pin myself to core 0. */
-		pin_to_core(0);
+		pin_to_core(placement_cpu(0));
 
 		/* Get core 0's tsc frequency. */
-		tdata[0].tsc_freq = get_tsc_freq();
+		atomic_set(&tdata[0]->start, 1);
+		tdata[0]->tsc_freq = get_tsc_freq();
+		tdata[0]->cpu = sched_getcpu();
 
 		/* Barrier waiting for all other threads to come up. */
-		while (barrier < (ncpus - 1))
-			cmb();
+		tree_barrier_gather(&barrier, 0);
 
 		/* Set the alarm */
+		jitter_begin();
+		cpu_usage_begin(&usage);
 		alarm(time);
 
 		/* Release the threads */
-		barrier++;
+		tree_barrier_release(&barrier);
 
 		/* Become thread 0 */
 		thread_handler(0);
@@ -194,11 +382,26 @@ void multi_core_tests(int ncpus, int tpc, int time, bool human)
 		/* When we get here, the alarm went off and we need to conclude the
 		 * test. Stop the other threads. */
 		for (int i=1; i<ncpus; i++)
-			tdata[i].stop = true;
+			tdata[i]->stop = true;
 		for (int i=1; i<ncpus; i++)
-			while (!tdata[i].done)
+			while (!tdata[i]->done)
 				cpu_relax();
+		cpu_usage_end(&usage);
+		if (jitter_end())
+			nr_noisy++;
+
+		/* Reap the threads so they've all written out their counts, and
+		 * the next point in the sweep starts clean. */
+		for (int i = 1; i < ncpus * tpc; i++)
+			pthread_join(threads[i], NULL);
+		for (int i=0; i<ncpus; i++)
+			tdata[i]->count = 0;
+		for (int i = 0; i < ncpus * tpc; i++)
+			tdata[tcounts[i].core]->count += tcounts[i].count;
 		dump_results(run_prefix, human);
+		if (human)
+			jitter_report(stdout);
+		tree_barrier_destroy(&barrier);
 	}
 
 	/* Set up the alarm */
@@ -208,37 +411,59 @@ void multi_core_tests(int ncpus, int tpc, int time, bool human)
 	act.sa_flags = 0;
 	sigaction(SIGALRM, &act, NULL);
 
-	/* Run the tests */
-	run_test("CTXSWITCH", time, yieldloop);
-}
-
-void print_header(char *name, int ncpus, int tpc, int time, bool human)
-{
-	if (human)
-		printf("%s tests: ncpus: %d, tpc: %d, duration: %ds\n",
-		       name, ncpus, tpc, time);
-	else
-		printf("%s:%d:%d:%d\n", name, ncpus, tpc, time);
+	/* Run the tests.  Once a vcore has been requested, the upthread
+	 * libraries keep it until the process exits, so a point with fewer cores
+	 * than the one before it would run with spare vcores spinning away.
+	 * Walk the core counts in increasing order, in the outer loop, so the
+	 * vcore count only ever grows. */
+	int cmp(const void *a, const void *b)
+	{
+		return *(int*)a - *(int*)b;
+	}
+	qsort(ncpus_list, nr_ncpus, sizeof(int), cmp);
+	for (int c = 0; c < nr_ncpus; c++) {
+		for (int t = 0; t < nr_tpcs; t++) {
+			ncpus = ncpus_list[c];
+			tpc = tpc_list[t];
+			print_header("ctxswitch", ncpus, tpc, time, human);
+			run_test("CTXSWITCH", time);
+			fflush(stdout);
+		}
+	}
+	return nr_noisy;
 }
 
 int main (int argc, char **argv)
 {
-	int ncpus = 12;
-	int tpc = 1;
+	char *ncpus = "12";
+	char *tpc = "1";
 	int time = 10;
 	bool human = true;
+	int *ncpus_list, *tpc_list;
+	int nr_ncpus, nr_tpcs;
 
 	if (argc > 1)
-		ncpus = strtol(argv[1], 0, 10);
+		ncpus = argv[1];
 	if (argc > 2)
-		tpc = strtol(argv[2], 0, 10);
+		tpc = argv[2];
 	if (argc > 3)
 		time = strtol(argv[3], 0, 10);
 	if (argc > 4)
 		human = strtol(argv[4], 0, 10);
 
-	print_header("ctxswitch", ncpus, tpc, time, human);
-	multi_core_tests(ncpus, tpc, time, human);
+	topology_init();
+	results_init("ctxswitch", argc, argv);
+	/* Fork any jitter samplers before the thread library is up. */
+	jitter_init();
+	result_topology();
+	if (!human)
+		print_topology(stderr, 0);
+	nr_ncpus = parse_list(ncpus, &ncpus_list);
+	nr_tpcs = parse_list(tpc, &tpc_list);
+	/* Tell the run scripts some points weren't worth keeping. */
+	if (multi_core_tests(ncpus_list, nr_ncpus, tpc_list, nr_tpcs, time, human))
+		return 3;
+	return 0;
 }
 
 
@@ -22,10 +22,31 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
 #include <parlib/vcore.h>
 #include <parlib/timing.h>
 #include <parlib/arch.h>
 #include "../libconfig.h"
+#include "../barrier.h"
+#include "../results.h"
+#include "../jitter.h"
+#include "../cpuusage.h"
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE (1 << 16)
+#endif
+
+#ifdef USE_PTHREAD
+	/* Cpu ids run up to the configured count, even with some offline. */
+	#define trace_vcore() sched_getcpu()
+	#define trace_nr_vcores() get_nprocs_conf()
+#else
+	#define trace_vcore() vcore_id()
+	#define trace_nr_vcores() max_vcores()
+#endif
 
 /* Modifiable via command line */
 int nr_threads = 1;
@@ -33,15 +54,103 @@ int nr_loops = 1;
 int fake_work = 0;
 int human_dump = 1;
 int preempt_period = PREEMPT_PERIOD;
-static int barrier = 0;
+char *work_dist = "fixed";
+char *delay_dist = "none";
+long seed = 0;
+int trace_chunk = 0;
+char *trace_file = "fixedwork.trace";
+int self_check = 0;
+static struct tree_barrier barrier;
+
+/* Distributions used to hand out per-thread work and start delays.  A
+ * distribution is given on the command line as "name[:param[:param]]". */
+enum dist_type {
+	DIST_FIXED,    /* work: nr_loops each       delay: none */
+	DIST_UNIFORM,  /* work: [p0, p1]*nr_loops   delay: [0, p0) usec */
+	DIST_BIMODAL,  /* work: p0 of the threads do p1*nr_loops, the rest nr_loops */
+	DIST_ZIPF,     /* work: rank^-p0, scaled so the mean is nr_loops */
+	DIST_EXP,      /* work: mean nr_loops       delay: poisson, mean p0 usec apart */
+	DIST_PHASED,   /* delay: p0 groups of threads arriving p1 usec apart */
+};
+
+struct dist {
+	enum dist_type type;
+	double p[2];
+};
 
+/* What each distribution can be used for. */
+#define DIST_WORK  0x1
+#define DIST_DELAY 0x2
+
+/* The params mean different things in each role (multiples of nr_loops for
+ * work, usecs for delays), so each role has its own defaults. */
+static struct {
+	char *name;
+	enum dist_type type;
+	int roles;
+	double work_defaults[2];
+	double delay_defaults[2];
+} dist_table[] = {
+	{"fixed",   DIST_FIXED,   DIST_WORK | DIST_DELAY, {0, 0},     {0, 0}},
+	{"none",    DIST_FIXED,   DIST_WORK | DIST_DELAY, {0, 0},     {0, 0}},
+	{"uniform", DIST_UNIFORM, DIST_WORK | DIST_DELAY, {0.5, 1.5}, {1000, 0}},
+	{"bimodal", DIST_BIMODAL, DIST_WORK,              {0.1, 10},  {0, 0}},
+	{"zipf",    DIST_ZIPF,    DIST_WORK,              {1.0, 0},   {0, 0}},
+	{"exp",     DIST_EXP,     DIST_WORK | DIST_DELAY, {0, 0},     {1000, 0}},
+	{"phased",  DIST_PHASED,  DIST_DELAY,             {0, 0},     {4, 100000}},
+};
+
+/* One cache line per thread, so threads don't false share when writing their
+ * start and end times. */
 struct stats {
 	uint64_t create_time;
 	uint64_t start_time;
 	uint64_t end_time;
 	uint64_t join_time;
+	uint64_t nr_loops;
+	uint64_t start_delay;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* The harness's own costs, measured when self_check is set. */
+struct overhead {
+	uint64_t read_tsc;
+	uint64_t trace_event;
+	uint64_t empty_run;
+};
+
+/* Trace events, logged per vcore when trace_chunk is non-zero.  The dump is
+ * a struct trace_hdr, followed by (vcore, nr_recs) and nr_recs struct
+ * trace_recs for each vcore.  See python/trace2chrome.py. */
+enum trace_event {
+	TRACE_START,
+	TRACE_CHUNK,
+	TRACE_YIELD,
+	TRACE_RESUME,
+	TRACE_END,
 };
 
+struct trace_rec {
+	uint64_t tsc;
+	uint16_t vcore;
+	uint16_t event;
+	uint32_t tid;
+};
+
+struct trace_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_vcores;
+	uint64_t tsc_freq;
+	uint64_t prog_start;
+};
+
+struct trace_ring {
+	uint64_t head;
+	struct trace_rec *recs;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct trace_ring *trace_rings = NULL;
+
 /* Variables for the thread handles and gathering statistics */
 pthread_t *thandles = NULL;
 struct stats *tstats = NULL;
@@ -58,14 +167,197 @@ static void parse_args(int argc, char **argv)
 		human_dump = strtol(argv[4], 0, 10);
 	if (argc > 5)
 		preempt_period = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		work_dist = argv[6];
+	if (argc > 7)
+		delay_dist = argv[7];
+	if (argc > 8)
+		seed = strtol(argv[8], 0, 10);
+	if (argc > 9)
+		trace_chunk = strtol(argv[9], 0, 10);
+	if (argc > 10)
+		trace_file = argv[10];
+	if (argc > 11)
+		self_check = strtol(argv[11], 0, 10);
+}
+
+static void trace_init(void)
+{
+	int nr_vcores = trace_nr_vcores();
+	trace_rings = aligned_alloc(ARCH_CL_SIZE,
+	                            sizeof(struct trace_ring) * nr_vcores);
+	for (int i = 0; i < nr_vcores; i++) {
+		trace_rings[i].head = 0;
+		trace_rings[i].recs = calloc(TRACE_RING_SIZE, sizeof(struct trace_rec));
+	}
+}
+
+static inline void trace_event(int id, int event)
+{
+	if (!trace_chunk)
+		return;
+	/* Kernel threads sharing a core can interleave here, so claim the slot
+	 * atomically.  Once the ring wraps we overwrite the oldest records. */
+	int vcore = trace_vcore();
+	struct trace_ring *ring = &trace_rings[vcore];
+	uint64_t slot = __sync_fetch_and_add(&ring->head, 1);
+	struct trace_rec *rec = &ring->recs[slot & (TRACE_RING_SIZE - 1)];
+	rec->tsc = read_tsc();
+	rec->vcore = vcore;
+	rec->event = event;
+	rec->tid = id;
+}
+
+static void trace_dump(uint64_t prog_start)
+{
+	FILE *f = fopen(trace_file, "w");
+	if (!f) {
+		perror(trace_file);
+		return;
+	}
+	struct trace_hdr hdr = {
+		.magic = "FWTRACE",
+		.version = 1,
+		.nr_vcores = trace_nr_vcores(),
+		.tsc_freq = get_tsc_freq(),
+		.prog_start = prog_start,
+	};
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (uint32_t i = 0; i < hdr.nr_vcores; i++) {
+		uint64_t head = trace_rings[i].head;
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		uint32_t nr_recs = head - first;
+		fwrite(&i, sizeof(i), 1, f);
+		fwrite(&nr_recs, sizeof(nr_recs), 1, f);
+		for (uint64_t j = first; j < head; j++)
+			fwrite(&trace_rings[i].recs[j & (TRACE_RING_SIZE - 1)],
+			       sizeof(struct trace_rec), 1, f);
+	}
+	fclose(f);
+}
+
+/* Parse 'spec' into 'd', for use as a DIST_WORK or DIST_DELAY distribution.
+ * A distribution that means nothing in that role is an error, rather than
+ * silently acting like "fixed". */
+static void parse_dist(char *spec, struct dist *d, int role)
+{
+	char *s = strdup(spec);
+	char *name = strtok(s, ":");
+	int i;
+
+	for (i = 0; i < sizeof(dist_table)/sizeof(dist_table[0]); i++)
+		if (name && !strcmp(name, dist_table[i].name))
+			break;
+	if (i == sizeof(dist_table)/sizeof(dist_table[0])) {
+		fprintf(stderr, "Unknown distribution: %s\n", spec);
+		exit(1);
+	}
+	if (!(dist_table[i].roles & role)) {
+		fprintf(stderr, "Not a %s distribution: %s\n",
+		        role == DIST_WORK ? "work" : "delay", spec);
+		exit(1);
+	}
+	d->type = dist_table[i].type;
+	double *defaults = role == DIST_WORK ? dist_table[i].work_defaults
+	                                     : dist_table[i].delay_defaults;
+	for (int j = 0; j < 2; j++) {
+		char *param = strtok(NULL, ":");
+		d->p[j] = param ? strtod(param, 0) : defaults[j];
+	}
+	free(s);
+}
+
+/* Fill in the per-thread loop counts according to the work distribution. */
+static void assign_work(struct dist *d)
+{
+	double zipf_sum = 0;
+	int *rank = NULL;
+
+	if (d->type == DIST_ZIPF) {
+		/* Shuffle the ranks so the heavy threads aren't just the ones that
+		 * happened to be created first. */
+		rank = malloc(sizeof(int) * nr_threads);
+		for (int i = 0; i < nr_threads; i++) {
+			rank[i] = i + 1;
+			zipf_sum += pow(i + 1, -d->p[0]);
+		}
+		for (int i = nr_threads - 1; i > 0; i--) {
+			int j = lrand48() % (i + 1);
+			int tmp = rank[i];
+			rank[i] = rank[j];
+			rank[j] = tmp;
+		}
+	}
+
+	for (int i = 0; i < nr_threads; i++) {
+		double w = 1.0;
+		switch (d->type) {
+			case DIST_UNIFORM:
+				w = d->p[0] + (d->p[1] - d->p[0]) * drand48();
+				break;
+			case DIST_BIMODAL:
+				w = drand48() < d->p[0] ? d->p[1] : 1.0;
+				break;
+			case DIST_ZIPF:
+				w = pow(rank[i], -d->p[0]) * nr_threads / zipf_sum;
+				break;
+			case DIST_EXP:
+				w = -log(1.0 - drand48());
+				break;
+			default:
+				break;
+		}
+		tstats[i].nr_loops = MAX((uint64_t)(w * nr_loops + 0.5), 1);
+	}
+	free(rank);
+}
+
+/* Fill in the per-thread start delays (in tsc ticks) according to the delay
+ * distribution.  Delays are measured from the moment the barrier drops. */
+static void assign_delays(struct dist *d)
+{
+	double arrival = 0;
+
+	for (int i = 0; i < nr_threads; i++) {
+		double usec = 0;
+		switch (d->type) {
+			case DIST_UNIFORM:
+				usec = d->p[0] * drand48();
+				break;
+			case DIST_EXP:
+				arrival += -log(1.0 - drand48()) * d->p[0];
+				usec = arrival;
+				break;
+			case DIST_PHASED:
+				usec = (i * (int)d->p[0] / nr_threads) * d->p[1];
+				break;
+			default:
+				break;
+		}
+		tstats[i].start_delay = usec2tsc((uint64_t)usec);
+	}
+
+	/* A delay distribution whose params round every delay down to nothing
+	 * would quietly run as "none". */
+	if (d->type != DIST_FIXED) {
+		uint64_t max_delay = 0;
+		for (int i = 0; i < nr_threads; i++)
+			max_delay = MAX(max_delay, tstats[i].start_delay);
+		if (!max_delay) {
+			fprintf(stderr, "Delay distribution %s gives every thread a "
+			        "zero delay\n", delay_dist);
+			exit(1);
+		}
+	}
 }
 
 static void dump_stats(int i, struct stats *stats, uint64_t prog_start,
                        uint64_t prog_end, int human)
 {
 	if (!human) {
-		printf("%d:%ld:%ld:%ld:%ld\n", i, stats->create_time,
-		       stats->start_time, stats->end_time, stats->join_time);
+		printf("%d:%ld:%ld:%ld:%ld:%ld:%ld\n", i, stats->create_time,
+		       stats->start_time, stats->end_time, stats->join_time,
+		       stats->nr_loops, stats->start_delay);
 	} else {
 		uint64_t start_time = tsc2msec(stats->start_time - stats->create_time);
 		uint64_t end_time = tsc2msec(stats->end_time - stats->create_time);
@@ -73,6 +365,8 @@ static void dump_stats(int i, struct stats *stats, uint64_t prog_start,
 		uint64_t run_time = tsc2msec(stats->join_time - stats->create_time);
 		uint64_t completion_time = tsc2msec(stats->end_time - prog_start);
 		printf("id:              %d\n", i);
+		printf("nr_loops:        %ld\n", stats->nr_loops);
+		printf("start_delay:     %ldms\n", tsc2msec(stats->start_delay));
 		printf("start_time:      %ldms\n", start_time);
 		printf("end_time:        %ldms\n", end_time);
 		printf("compute_time:    %ldms\n", compute_time);
@@ -86,44 +380,52 @@ static void *__thread_wrapper(void *arg)
 {
 	int id = (int)(long)arg;
 
-	/* Up the barrier. */
-	__sync_fetch_and_add(&barrier, 1);
+	/* Checkin and barrier waiting for all threads to come up.  Thread 0 is
+	 * main, which already gathered everyone and released the barrier. */
+	if (id != 0)
+		tree_barrier_wait(&barrier, id);
 
-	/* Checkin and barrier waiting for all cpus to come up. */
-	while (barrier < nr_threads)
-		pthread_yield();
+	/* Hold off until our arrival time comes up. */
+	if (tstats[id].start_delay) {
+		uint64_t arrival = read_tsc() + tstats[id].start_delay;
+		while (read_tsc() < arrival)
+			pthread_yield();
+	}
 
-	/* Let the games begin! */
+	/* Let the games begin! When tracing, break the loop into chunks so we
+	 * can log a timestamp at each chunk boundary. */
+	uint64_t loops = tstats[id].nr_loops;
+	uint64_t chunk = trace_chunk ? trace_chunk : loops;
 	tstats[id].start_time = read_tsc();
-	for (int i = 0; i < nr_loops; i++) {
-		for (int j=0; j<fake_work; j++)
-			cmb();
-		#ifdef WITH_YIELD
-		pthread_yield();
-		#endif
+	trace_event(id, TRACE_START);
+	for (uint64_t i = 0; i < loops; i += chunk) {
+		uint64_t n = MIN(chunk, loops - i);
+		for (uint64_t k = 0; k < n; k++) {
+			for (int j=0; j<fake_work; j++)
+				cmb();
+			#ifdef WITH_YIELD
+			trace_event(id, TRACE_YIELD);
+			pthread_yield();
+			trace_event(id, TRACE_RESUME);
+			#endif
+		}
+		trace_event(id, TRACE_CHUNK);
 	}
+	trace_event(id, TRACE_END);
 	tstats[id].end_time = read_tsc();
 }
 
-int main(int argc, char **argv)
+static void run_threads(uint64_t *prog_start, uint64_t *prog_end)
 {
-	parse_args(argc, argv);
-	thandles = calloc(sizeof(pthread_t), nr_threads);
-	tstats = calloc(sizeof(struct stats), nr_threads);
-
-	/* Do any library specific test prep */
-	test_prep();
-
-	/* Let the games begin! */
 	for (int i=1; i<nr_threads; i++) {
 		tstats[i].create_time = read_tsc();
 		pthread_create(&thandles[i], NULL, __thread_wrapper, (void*)(long)i);
 	}
 
 	/* Wait to start the measurement. */
-	while (barrier < (nr_threads - 1))
-		pthread_yield();
-	uint64_t prog_start = read_tsc();
+	tree_barrier_gather(&barrier, 0);
+	*prog_start = read_tsc();
+	tree_barrier_release(&barrier);
 
 	/* Become thread 0 */
 	tstats[0].create_time = read_tsc();
@@ -135,16 +437,178 @@ int main(int argc, char **argv)
 		pthread_join(thandles[i], NULL);
 		tstats[i].join_time = read_tsc();
 	}
-	uint64_t prog_end = read_tsc();
+	*prog_end = read_tsc();
+}
+
+/* Measure what the harness itself costs: a timestamp, a trace record, and a
+ * full create/barrier/join cycle of all the threads with no work to do. */
+static void measure_overhead(struct overhead *o)
+{
+	const int iters = 100000;
+	uint64_t beg, end;
+
+	beg = read_tsc();
+	for (int i = 0; i < iters; i++)
+		read_tsc();
+	end = read_tsc();
+	o->read_tsc = (end - beg) / iters;
+
+	if (trace_chunk) {
+		beg = read_tsc();
+		for (int i = 0; i < iters; i++)
+			trace_event(0, TRACE_CHUNK);
+		end = read_tsc();
+		o->trace_event = (end - beg) / iters;
+		trace_rings[trace_vcore()].head = 0;
+	}
+
+	/* Run with no work and no delays, then put the real values back. */
+	struct stats *saved = malloc(sizeof(struct stats) * nr_threads);
+	memcpy(saved, tstats, sizeof(struct stats) * nr_threads);
+	for (int i = 0; i < nr_threads; i++) {
+		tstats[i].nr_loops = 0;
+		tstats[i].start_delay = 0;
+	}
+	int saved_trace_chunk = trace_chunk;
+	trace_chunk = 0;
+	run_threads(&beg, &end);
+	trace_chunk = saved_trace_chunk;
+	o->empty_run = end - beg;
+	memcpy(tstats, saved, sizeof(struct stats) * nr_threads);
+	free(saved);
+}
+
+static void __record_params(struct result *r)
+{
+	result_param_int(r, "nr_threads", nr_threads);
+	result_param_int(r, "nr_loops", nr_loops);
+	result_param_int(r, "fake_work", fake_work);
+	result_param_int(r, "preempt_period", preempt_period);
+	result_param_str(r, "work_dist", work_dist);
+	result_param_str(r, "delay_dist", delay_dist);
+	result_param_int(r, "seed", seed);
+}
+
+/* One record for the run as a whole, and one per thread with the same fields
+ * as the machine readable dump. */
+static void record_results(uint64_t prog_start, uint64_t prog_end,
+                           struct overhead *overhead, struct cpu_usage *usage,
+                           uint64_t total_loops)
+{
+	struct result r;
+	if (!results_enabled())
+		return;
+
+	result_begin(&r, "run");
+	__record_params(&r);
+	result_metric_int(&r, "tsc_freq", get_tsc_freq());
+	result_metric_int(&r, "start", prog_start);
+	result_metric_int(&r, "end", prog_end);
+	result_metric_double(&r, "run_ms", tsc2usec(prog_end - prog_start) / 1e3);
+	if (self_check) {
+		result_metric_int(&r, "overhead_read_tsc", overhead->read_tsc);
+		result_metric_int(&r, "overhead_trace", overhead->trace_event);
+		result_metric_int(&r, "overhead_empty_run", overhead->empty_run);
+	}
+	result_cpu_usage(&r, usage, total_loops, tree_barrier_spins(&barrier));
+	result_end(&r);
+
+	for (int i=0; i<nr_threads; i++) {
+		result_begin(&r, "thread");
+		__record_params(&r);
+		result_param_int(&r, "id", i);
+		result_metric_int(&r, "create", tstats[i].create_time);
+		result_metric_int(&r, "start", tstats[i].start_time);
+		result_metric_int(&r, "end", tstats[i].end_time);
+		result_metric_int(&r, "join", tstats[i].join_time);
+		result_metric_int(&r, "nr_loops", tstats[i].nr_loops);
+		result_metric_int(&r, "start_delay", tstats[i].start_delay);
+		result_end(&r);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	results_init("fixedwork", argc, argv);
+	/* Fork any jitter samplers before the thread library is up. */
+	jitter_init();
+	thandles = calloc(sizeof(pthread_t), nr_threads);
+	tstats = aligned_alloc(ARCH_CL_SIZE, sizeof(struct stats) * nr_threads);
+	memset(tstats, 0, sizeof(struct stats) * nr_threads);
+
+	/* Hand out the per-thread work and start delays. */
+	struct dist wdist, ddist;
+	parse_dist(work_dist, &wdist, DIST_WORK);
+	parse_dist(delay_dist, &ddist, DIST_DELAY);
+	srand48(seed);
+	assign_work(&wdist);
+	assign_delays(&ddist);
+
+	/* Do any library specific test prep, off the jitter samplers' cpus. */
+	jitter_reserve_cpus();
+	test_prep();
+	tree_barrier_init(&barrier, nr_threads,
+	                  TREE_BARRIER_YIELD | TREE_BARRIER_GATED);
+	if (trace_chunk)
+		trace_init();
+
+	/* Measure ourselves first if asked to. */
+	struct overhead overhead = {0};
+	if (self_check)
+		measure_overhead(&overhead);
+
+	/* Let the games begin! */
+	uint64_t prog_start, prog_end;
+	struct cpu_usage usage;
+	jitter_begin();
+	cpu_usage_begin(&usage);
+	run_threads(&prog_start, &prog_end);
+	cpu_usage_end(&usage);
+	bool noisy = jitter_end();
+	if (trace_chunk)
+		trace_dump(prog_start);
 
 	/* Dump the results */
-	if (!human_dump)
-		printf("%ld:%ld:%ld\n", get_tsc_freq(), prog_start, prog_end);
+	uint64_t total_loops = 0;
+	for (int i=0; i<nr_threads; i++)
+		total_loops += tstats[i].nr_loops;
+	record_results(prog_start, prog_end, &overhead, &usage, total_loops);
+	if (!human_dump) {
+		printf("%ld:%ld:%ld", get_tsc_freq(), prog_start, prog_end);
+		if (self_check)
+			printf(":%ld:%ld:%ld", overhead.read_tsc, overhead.trace_event,
+			       overhead.empty_run);
+		printf("\n");
+	}
 	for (int i=0; i<nr_threads; i++) {
 		dump_stats(i, &tstats[i], prog_start, prog_end, human_dump);
 	}
-	if (human_dump)
+	if (human_dump) {
+		/* Jain's index over the per-loop response times, so threads given
+		 * different amounts of work can be compared. */
+		double sum = 0, sumsq = 0;
+		for (int i=0; i<nr_threads; i++) {
+			double r = (double)(tstats[i].end_time - prog_start
+			                    - tstats[i].start_delay) / tstats[i].nr_loops;
+			sum += r;
+			sumsq += r * r;
+		}
 		printf("Program run: %ldms\n", tsc2msec(prog_end - prog_start));
-	return 0;
+		printf("Fairness: %.4f\n", sum * sum / (nr_threads * sumsq));
+		print_cpu_usage(stdout, &usage, total_loops,
+		                tree_barrier_spins(&barrier));
+		if (self_check) {
+			printf("Harness overhead:\n");
+			printf("  read_tsc:    %ldns\n", tsc2nsec(overhead.read_tsc));
+			printf("  trace_event: %ldns\n", tsc2nsec(overhead.trace_event));
+			printf("  empty run:   %ldus (%.2f%% of program run)\n",
+			       tsc2usec(overhead.empty_run),
+			       100.0 * overhead.empty_run / (prog_end - prog_start));
+		}
+		jitter_report(stdout);
+	}
+	/* Tell the run scripts not to keep this one. */
+	return noisy ? 3 : 0;
 }
 
@@ -1,4 +1,4 @@
-#!/usr/bin/arch -i386 python2.7
+#!/usr/bin/env python3
 #
 # Author: Kevin Klues <klueska@cs.berkeley.edu>
 
@@ -12,55 +12,147 @@ matplotlib.use('Agg')
 from pylab import *
 import numpy as np
 from collections import OrderedDict
-import json
+
+# Bump whenever the dtypes below change, to throw away old caches.
+CACHE_VERSION = 1
+CACHE_FILE = '.fixedwork-cache.npz'
+
+# One per run, from the first line of its .dat file.  The overheads are only
+# there when the run was made with self_check set.
+RUN_DTYPE = np.dtype([
+  ('iteration', np.int64),
+  ('tsc_freq', np.int64),
+  ('prog_start', np.int64),
+  ('prog_end', np.int64),
+  ('read_tsc_overhead', np.int64),
+  ('trace_overhead', np.int64),
+  ('empty_run', np.int64),
+])
+
+# One per thread per run, in the order of the fields in the .dat file.
+THREAD_DTYPE = np.dtype([
+  ('id', np.int64),
+  ('create_time', np.int64),
+  ('start_time', np.int64),
+  ('end_time', np.int64),
+  ('join_time', np.int64),
+  ('num_loops', np.int64),
+  ('start_delay', np.int64),
+])
 
 class BenchmarkData:
+  """runs[lib] holds a RUN_DTYPE array ordered by iteration, and tstats[lib]
+     the matching (runs x threads) THREAD_DTYPE array."""
   def __init__(self, config):
     input_folder = config.input_folder
     self.dir_name = os.path.basename(input_folder)
-    m = re.match('fixedwork-out-(?P<num_threads>.*)-(?P<num_loops>.*)-(?P<fake_work>.*)', self.dir_name)
+    m = re.match(r'fixedwork-out-(?P<num_threads>\d+)-(?P<num_loops>\d+)-(?P<fake_work>\d+)(-(?P<work_dist>[^-]*)-(?P<delay_dist>[^-]*))?$', self.dir_name)
     self.num_threads = int(m.group('num_threads'))
     self.num_loops = int(m.group('num_loops'))
     self.fake_work = int(m.group('fake_work'))
-    self.files = glob.glob(input_folder + '/*')
-    self.data = {}
-    map(lambda x: FileData(x, self), self.files)
-
-class FileData:
-  def __init__(self, f, bdata):
-    self.file_name = os.path.basename(f)
-    m = re.match('(?P<lib>.*)-fixedwork-out-(?P<iter>.*).dat', self.file_name)
-    self.lib = m.group('lib')
-    self.iteration = int(m.group('iter'))
-    lines = map(lambda x: x.strip().split(':'), file(f).readlines())
-    self.tsc_freq = int(lines[0][0])
-    self.prog_start = int(lines[0][1])
-    self.prog_end = int(lines[0][2])
-    self.tstats = map(lambda x: ThreadStats(x), lines[1:])
-    bdata.data.setdefault(self.lib, {})
-    bdata.data[self.lib][self.iteration] = self
-
-class ThreadStats:
-  def __init__(self, line):
-    self.id = int(line[0])
-    self.create_time = int(line[1])
-    self.start_time = int(line[2])
-    self.end_time = int(line[3])
-    self.join_time = int(line[4])
+    self.work_dist = m.group('work_dist') or 'fixed'
+    self.delay_dist = m.group('delay_dist') or 'none'
+    self.files = sorted(glob.glob(input_folder + '/*.dat'))
+    self.runs = OrderedDict()
+    self.tstats = OrderedDict()
+
+    cache = os.path.join(input_folder, CACHE_FILE)
+    if not self.load_cache(cache):
+      self.parse()
+      self.save_cache(cache)
+
+    for lib, runs in self.runs.items():
+      length = runs['prog_end'] - runs['prog_start']
+      for r in runs[runs['empty_run'] > 0.01 * length]:
+        print("warning: %s run %d: harness overhead is %.1f%% of the run"
+              % (lib, r['iteration'], 100.0 * r['empty_run']
+                                      / (r['prog_end'] - r['prog_start'])))
+
+  def stamps(self):
+    return np.array([[os.path.getmtime(f), os.path.getsize(f)]
+                     for f in self.files], dtype=np.float64).reshape(-1, 2)
+
+  def load_cache(self, cache):
+    """Use the cached arrays if they came from exactly these .dat files."""
+    if not os.path.exists(cache):
+      return False
+    with np.load(cache) as c:
+      if (int(c['version']) != CACHE_VERSION
+          or list(c['files']) != [os.path.basename(f) for f in self.files]
+          or not np.array_equal(c['stamps'], self.stamps())):
+        return False
+      for lib in c['libs']:
+        self.runs[str(lib)] = c['runs:' + lib]
+        self.tstats[str(lib)] = c['tstats:' + lib]
+    return True
+
+  def save_cache(self, cache):
+    arrays = {
+      'version': np.array(CACHE_VERSION),
+      'files': np.array([os.path.basename(f) for f in self.files]),
+      'stamps': self.stamps(),
+      'libs': np.array(list(self.runs.keys())),
+    }
+    for lib in self.runs:
+      arrays['runs:' + lib] = self.runs[lib]
+      arrays['tstats:' + lib] = self.tstats[lib]
+    try:
+      np.savez(cache, **arrays)
+    except (IOError, OSError) as e:
+      print("warning: can't cache results in %s: %s" % (cache, e))
+
+  def parse(self):
+    runs = {}
+    tstats = {}
+    for f in self.files:
+      m = re.match(r'(?P<lib>.*)-fixedwork-out-(?P<iter>.*)\.dat$',
+                   os.path.basename(f))
+      lib = m.group('lib')
+      run, threads = parse_file(f, int(m.group('iter')), self.num_loops)
+      runs.setdefault(lib, []).append(run)
+      tstats.setdefault(lib, []).append(threads)
+    for lib in sorted(runs):
+      order = np.argsort([r['iteration'] for r in runs[lib]])
+      self.runs[lib] = np.array([runs[lib][i] for i in order], dtype=RUN_DTYPE)
+      self.tstats[lib] = np.stack([tstats[lib][i] for i in order])
+
+def parse_file(f, iteration, num_loops):
+  with open(f) as fd:
+    header = fd.readline().strip().split(':')
+    body = fd.read()
+  run = np.zeros((), dtype=RUN_DTYPE)
+  run['iteration'] = iteration
+  for name, val in zip(RUN_DTYPE.names[1:], header):
+    run[name] = int(val)
+
+  ncols = body[:body.find('\n')].count(':') + 1
+  fields = np.array(body.replace(':', ' ').split(), dtype=np.int64)
+  fields = fields.reshape(-1, ncols)
+  threads = np.zeros(len(fields), dtype=THREAD_DTYPE)
+  for i, name in enumerate(THREAD_DTYPE.names[:ncols]):
+    threads[name] = fields[:, i]
+  # Older runs gave every thread the same work and no start delay
+  if ncols <= THREAD_DTYPE.names.index('num_loops'):
+    threads['num_loops'] = num_loops
+  return run, threads
+
+def avg_sorted(ticks, scale):
+  """Sort each run's per-thread values, scale them, and average across runs
+     at each rank."""
+  return np.mean(np.sort(ticks, axis=1) * scale, axis=0)
+
+def legend_handles(leg):
+  return getattr(leg, 'legend_handles', None) or leg.legendHandles
 
 def graph_compute_times(bdata, config):
   title("Total Compute Time Per Thread")
   xlabel("Thread Number (Ordered by Compute Time)")
   ylabel("Total Compute Time (ms)")
-  for lib in bdata.data.keys():
-    ticks = []
-    for i in bdata.data[lib].keys():
-      tsc_freq = bdata.data[lib][i].tsc_freq
-      t = map(lambda x: x.end_time - x.start_time, bdata.data[lib][i].tstats)
-      ticks.append(sorted(t))
-    avg_ticks = map(lambda x: np.mean(x), np.transpose(ticks))
-    avg_time = map(lambda x: x/tsc_freq*1000, avg_ticks)
-    plot(range(len(avg_time)), avg_time, label=lib)
+  for lib in bdata.runs:
+    runs, tstats = bdata.runs[lib], bdata.tstats[lib]
+    ticks = tstats['end_time'] - tstats['start_time']
+    avg_time = avg_sorted(ticks, 1000.0 / runs['tsc_freq'][:, None])
+    plot(np.arange(len(avg_time)), avg_time, label=lib)
   legend(framealpha=0.5, loc='best')
   figname = config.output_folder + "/compute_times.png"
   savefig(figname)
@@ -70,25 +162,25 @@ def graph_start_times(bdata, config):
   title("Start Time Per Thread")
   xlabel("Thread Number (Ordered by Start Time)")
   ylabel("Start Time (s)")
-  for lib in bdata.data.keys():
-    ticks = []
-    for i in bdata.data[lib].keys():
-      prog_start = bdata.data[lib][i].prog_start
-      tsc_freq = bdata.data[lib][i].tsc_freq
-      t = map(lambda x: x.start_time - prog_start, bdata.data[lib][i].tstats)
-      ticks.append(sorted(t))
-    avg_ticks = map(lambda x: np.mean(x), np.transpose(ticks))
-    avg_time = map(lambda x: x/tsc_freq, avg_ticks)
-    plot(range(len(avg_time)), avg_time, label=lib)
+  for lib in bdata.runs:
+    runs, tstats = bdata.runs[lib], bdata.tstats[lib]
+    ticks = tstats['start_time'] - runs['prog_start'][:, None]
+    avg_time = avg_sorted(ticks, 1.0 / runs['tsc_freq'][:, None])
+    plot(np.arange(len(avg_time)), avg_time, label=lib)
   legend(framealpha=0.5, loc='best')
   figname = config.output_folder + "/start_times.png"
   savefig(figname)
   clf()
 
+def completion_times(bdata, lib):
+  runs, tstats = bdata.runs[lib], bdata.tstats[lib]
+  ticks = tstats['end_time'] - runs['prog_start'][:, None]
+  return avg_sorted(ticks, 1.0 / runs['tsc_freq'][:, None])
+
 def graph_completion_times(bdata, config):
   t = "Average Thread Completion Time (%d runs)\n" \
     + "%d Threads Running %d Million Iterations Each" 
-  title(t % (len(bdata.data.itervalues().next()),
+  title(t % (len(next(iter(bdata.runs.values()))),
              bdata.num_threads,
              bdata.num_loops * bdata.fake_work / 1000000))
        
@@ -99,20 +191,13 @@ def graph_completion_times(bdata, config):
       libname = config.libs[lib]['alias']
     else:
       libname = lib
-    ticks = []
-    for i in bdata.data[lib].keys():
-      prog_start = bdata.data[lib][i].prog_start
-      tsc_freq = bdata.data[lib][i].tsc_freq
-      t = map(lambda x: x.end_time - prog_start, bdata.data[lib][i].tstats)
-      ticks.append(sorted(t))
-    avg_ticks = map(lambda x: np.mean(x), np.transpose(ticks))
-    avg_time = map(lambda x: x/tsc_freq, avg_ticks)
-    plot(range(len(avg_time)), avg_time, label=libname, linewidth=3,
+    avg_time = completion_times(bdata, lib)
+    plot(np.arange(len(avg_time)), avg_time, label=libname, linewidth=3,
          color=config.libs[lib]['color'])
     leg = legend(framealpha=0.5, prop={'size': 12},
                  loc=config.graphs['completion_times']['legend_loc'],
                  bbox_to_anchor=config.graphs['completion_times']['legend_bbox_to_anchor'])
-  for legobj in leg.legendHandles:
+  for legobj in legend_handles(leg):
     legobj.set_linewidth(10.0)
   figname = config.output_folder + "/completion_times.png"
   savefig(figname, bbox_inches="tight")
@@ -124,26 +209,19 @@ def graph_completion_times_inverse(bdata, config):
     #+ "(Average Over %d Runs)"
   title(t )#% (bdata.num_threads,
            #  bdata.num_loops * bdata.fake_work / 1000000,
-           #  len(bdata.data.itervalues().next())))
+           #  len(next(iter(bdata.runs.values())))))
 
   y_max = 0
   xlabel("Time (s)")
   ylabel("Total Threads Completed")
-  for lib in reversed(config.libs.keys()):
+  for lib in reversed(list(config.libs.keys())):
     if 'alias' in config.libs[lib].keys():
       libname = config.libs[lib]['alias']
     else:
       libname = lib
-    ticks = []
-    for i in bdata.data[lib].keys():
-      prog_start = bdata.data[lib][i].prog_start
-      tsc_freq = bdata.data[lib][i].tsc_freq
-      t = map(lambda x: x.end_time - prog_start, bdata.data[lib][i].tstats)
-      ticks.append(sorted(t))
-    avg_ticks = map(lambda x: np.mean(x), np.transpose(ticks))
-    avg_time = map(lambda x: x/tsc_freq, avg_ticks)
-    print json.dumps(avg_time, indent=4)
-    plot(avg_time, range(len(avg_time)), label=libname, linewidth=3,
+    avg_time = completion_times(bdata, lib)
+    print(json.dumps(avg_time.tolist(), indent=4))
+    plot(avg_time, np.arange(len(avg_time)), label=libname, linewidth=3,
          color=config.libs[lib]['color'])
     leg = legend(framealpha=0.5, prop={'size': 12},
                  loc=config.graphs['completion_times']['legend_loc'],
@@ -152,16 +230,58 @@ def graph_completion_times_inverse(bdata, config):
       y_max = len(avg_time)
   x1,x2,y1,y2 = axis()
   axis((x1,x2,y1,y_max))
-  for legobj in leg.legendHandles:
+  for legobj in legend_handles(leg):
     legobj.set_linewidth(10.0)
   figname = config.output_folder + "/completion_times_inverse.png"
   savefig(figname, bbox_inches="tight")
   clf()
 
+def jain_index(x):
+  x = np.asarray(x, dtype=float)
+  return x.sum()**2 / (len(x) * (x**2).sum())
+
+def graph_slowdowns(bdata, config):
+  title("Response Time Per Loop (%s work, %s arrivals)"
+        % (bdata.work_dist, bdata.delay_dist))
+  xlabel("Thread Number (Ordered by Response Time Per Loop)")
+  ylabel("Response Time Per Loop (us)")
+  for lib in bdata.runs:
+    runs, tstats = bdata.runs[lib], bdata.tstats[lib]
+    ticks = (tstats['end_time'] - runs['prog_start'][:, None]
+             - tstats['start_delay']) / tstats['num_loops'].astype(float)
+    avg_time = avg_sorted(ticks, 1000000.0 / runs['tsc_freq'][:, None])
+    print("%s: fairness (jain): %.4f" % (lib, jain_index(avg_time)))
+    plot(np.arange(len(avg_time)), avg_time, label=lib)
+  legend(framealpha=0.5, loc='best')
+  figname = config.output_folder + "/slowdowns.png"
+  savefig(figname)
+  clf()
+
+def graph_makespans(bdata, config):
+  title("Makespan (%s work, %s arrivals)"
+        % (bdata.work_dist, bdata.delay_dist))
+  ylabel("Makespan (s)")
+  libs = list(bdata.runs.keys())
+  avgs = []
+  stds = []
+  for lib in libs:
+    runs, tstats = bdata.runs[lib], bdata.tstats[lib]
+    spans = (1.0 * (tstats['end_time'].max(axis=1) - runs['prog_start'])
+             / runs['tsc_freq'])
+    avgs.append(np.mean(spans))
+    stds.append(np.std(spans))
+    print("%s: makespan: %.3fs +/- %.3fs" % (lib, avgs[-1], stds[-1]))
+  ind = np.arange(len(libs))
+  bar(ind, avgs, 0.6, yerr=stds, ecolor='k')
+  xticks(ind + 0.3, libs, rotation=20)
+  figname = config.output_folder + "/makespans.png"
+  savefig(figname, bbox_inches="tight")
+  clf()
+
 def generate_graphs(parser, args):
   config = lambda:None
   if args.config_file:
-    config.__dict__ = json.load(file(args.config_file), object_pairs_hook=OrderedDict)
+    config.__dict__ = json.load(open(args.config_file), object_pairs_hook=OrderedDict)
     if args.input_folder:
       config.input_folder = args.input_folder
     if args.output_folder:
@@ -182,4 +302,5 @@ def generate_graphs(parser, args):
   graph_start_times(bdata, config)
   graph_completion_times(bdata, config)
   graph_completion_times_inverse(bdata, config)
-
+  graph_slowdowns(bdata, config)
+  graph_makespans(bdata, config)
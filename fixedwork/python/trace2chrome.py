@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Convert the binary trace written by 'fixedwork ... <trace_chunk> <file>'
+# into the Chrome trace event format (load it in chrome://tracing or
+# ui.perfetto.dev).  Each vcore gets its own row, and each stretch of time a
+# thread spent running on a vcore shows up as a slice named after the thread.
+
+import sys
+import json
+import struct
+from argparse import ArgumentParser
+
+HDR = struct.Struct('<8sIIQQ')
+VCORE_HDR = struct.Struct('<II')
+REC = struct.Struct('<QHHI')
+
+TRACE_START, TRACE_CHUNK, TRACE_YIELD, TRACE_RESUME, TRACE_END = range(5)
+
+def load_trace(f):
+  data = open(f, 'rb').read()
+  magic, version, nr_vcores, tsc_freq, prog_start = HDR.unpack_from(data, 0)
+  if magic.rstrip(b'\0') != b'FWTRACE' or version != 1:
+    raise ValueError("%s is not a fixedwork trace" % f)
+  off = HDR.size
+  recs = []
+  for v in range(nr_vcores):
+    vcore, nr_recs = VCORE_HDR.unpack_from(data, off)
+    off += VCORE_HDR.size
+    for i in range(nr_recs):
+      recs.append(REC.unpack_from(data, off))
+      off += REC.size
+  return tsc_freq, prog_start, recs
+
+def to_chrome(tsc_freq, prog_start, recs):
+  usec = lambda tsc: (tsc - prog_start) * 1e6 / tsc_freq
+  events = []
+
+  # Walk each thread's records in time order.  Two consecutive records on the
+  # same vcore bound a slice the thread spent running there, unless the first
+  # one marks the thread giving up the core.
+  by_thread = {}
+  for r in recs:
+    by_thread.setdefault(r[3], []).append(r)
+  for tid, trecs in by_thread.items():
+    trecs.sort()
+    for a, b in zip(trecs, trecs[1:]):
+      if a[2] == TRACE_YIELD or a[1] != b[1]:
+        continue
+      events.append({
+        'name' : 'thread %d' % tid,
+        'cat'  : 'run',
+        'ph'   : 'X',
+        'pid'  : 0,
+        'tid'  : a[1],
+        'ts'   : usec(a[0]),
+        'dur'  : usec(b[0]) - usec(a[0]),
+        'args' : {'thread' : tid},
+      })
+    for r in trecs:
+      if r[2] in (TRACE_START, TRACE_END):
+        events.append({
+          'name' : '%s %d' % ('start' if r[2] == TRACE_START else 'end', tid),
+          'ph'   : 'i',
+          's'    : 't',
+          'pid'  : 0,
+          'tid'  : r[1],
+          'ts'   : usec(r[0]),
+        })
+
+  for v in sorted(set(r[1] for r in recs)):
+    events.append({'name' : 'thread_name', 'ph' : 'M', 'pid' : 0, 'tid' : v,
+                   'args' : {'name' : 'vcore %d' % v}})
+  return {'traceEvents' : events, 'displayTimeUnit' : 'ns'}
+
+parser = ArgumentParser(description="Convert a fixedwork trace to the "
+                                    "Chrome trace event format.")
+parser.add_argument('trace_file', metavar='TRACE_FILE',
+                    help="Binary trace file written by fixedwork.")
+parser.add_argument('-o', '--output-file', dest='output_file',
+                    metavar='OUTPUT_FILE', default=None,
+                    help="Where to write the json (default: stdout).")
+args = parser.parse_args()
+
+tsc_freq, prog_start, recs = load_trace(args.trace_file)
+out = open(args.output_file, 'w') if args.output_file else sys.stdout
+json.dump(to_chrome(tsc_freq, prog_start, recs), out)
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Find the upthread-juggle preemption period that minimizes fixedwork's
+# makespan (or tail completion time) for one configuration, instead of
+# sweeping a fixed list of periods 50 times over:
+#
+#   tune_preempt.py --threads 1024 --loops 300000 --fake-work 1000
+#
+# Candidate periods are spaced evenly in log space between --min-period and
+# --max-period, and searched with successive halving: each round, every
+# surviving candidate is topped up to that round's number of runs, and only
+# the best 1/--eta of them (by median) move on to the next round, which gets
+# --eta times as many runs.  Candidates with at least --min-runs runs whose
+# confidence interval is entirely worse than the leader's are dropped as soon
+# as that happens.  The search stops when one candidate is left or --max-runs
+# runs have been spent.
+#
+# Run i of every candidate uses seed i, so with random work or delay
+# distributions they all see the same draws.  We report the winner with a
+# bootstrap confidence interval on its median, and the range of periods we
+# couldn't tell apart from it.
+#
+# With JITTER_CPUS set (see ../../jitter.h), runs fixedwork flags as noisy
+# are thrown away and run again, up to --noisy-retries times.
+
+import sys
+import math
+import random
+import os
+import subprocess
+from argparse import ArgumentParser
+
+def median(xs):
+  xs = sorted(xs)
+  n = len(xs)
+  return xs[n // 2] if n % 2 else (xs[n // 2 - 1] + xs[n // 2]) / 2.0
+
+def bootstrap_ci(xs, level, iters=2000):
+  """Confidence interval on the median of xs."""
+  if len(xs) < 2:
+    return xs[0], xs[0]
+  rng = random.Random(0)
+  meds = sorted(median([rng.choice(xs) for _ in xs]) for _ in range(iters))
+  lo = meds[int((1 - level) / 2 * iters)]
+  hi = meds[min(iters - 1, int((1 + level) / 2 * iters))]
+  return lo, hi
+
+def percentile(xs, p):
+  xs = sorted(xs)
+  return xs[min(len(xs) - 1, int(p / 100.0 * len(xs)))]
+
+def run_fixedwork(args, period, seed):
+  """One run's objective, in milliseconds."""
+  cmd = [args.exec, str(args.threads), str(args.loops), str(args.fake_work),
+         '0', str(period), args.work_dist, args.delay_dist, str(seed)]
+  # Tuning runs look just like the sweep's, so keep them out of its results.
+  env = dict(os.environ)
+  env.pop('RESULTS_FILE', None)
+  for _ in range(args.noisy_retries + 1):
+    p = subprocess.run(cmd, stdout=subprocess.PIPE, universal_newlines=True,
+                       env=env)
+    if p.returncode != 3:
+      break
+  if p.returncode == 3:
+    sys.exit("%s: still noisy after %d retries" % (' '.join(cmd),
+                                                   args.noisy_retries))
+  if p.returncode:
+    raise subprocess.CalledProcessError(p.returncode, cmd)
+  out = p.stdout.split()
+  # tsc_freq:prog_start:prog_end, then id:create:start:end:join:loops:delay
+  freq, beg, end = [int(x) for x in out[0].split(':')[:3]]
+  if args.objective == 'makespan':
+    return (end - beg) * 1000.0 / freq
+  ends = [int(l.split(':')[3]) for l in out[1:] if l.count(':') == 6]
+  return (percentile(ends, args.tail) - beg) * 1000.0 / freq
+
+def candidates(args):
+  lo, hi = math.log(args.min_period), math.log(args.max_period)
+  n = args.points
+  periods = [int(round(math.exp(lo + (hi - lo) * i / (n - 1))))
+             for i in range(n)]
+  return sorted(set(periods))
+
+def tune(args):
+  samples = dict((p, []) for p in candidates(args))
+  alive = sorted(samples)
+  spent = 0
+  runs = args.initial_runs
+  rnd = 0
+
+  def log(msg):
+    if not args.quiet:
+      print(msg, file=sys.stderr)
+
+  while True:
+    rnd += 1
+    for p in alive:
+      while len(samples[p]) < runs and spent < args.max_runs:
+        samples[p].append(run_fixedwork(args, p, len(samples[p]) + 1))
+        spent += 1
+
+    measured = [p for p in alive if samples[p]]
+    cis = dict((p, bootstrap_ci(samples[p], args.confidence)) for p in measured)
+    best = min(measured, key=lambda p: median(samples[p]))
+    # Early stopping: drop anything we're already sure is worse, once we
+    # have enough runs to be sure of anything.
+    alive = [p for p in measured if len(samples[p]) < args.min_runs
+             or cis[p][0] <= cis[best][1]]
+    log("round %d: %d runs each, %d spent, leader %dus (%.1fms), "
+        "%d candidates left" % (rnd, runs, spent, best, median(samples[best]),
+                                len(alive)))
+    if len(alive) == 1 or spent >= args.max_runs:
+      break
+    alive.sort(key=lambda p: median(samples[p]))
+    alive = alive[:max(1, int(math.ceil(len(alive) / float(args.eta))))]
+    runs *= args.eta
+
+  best = min(alive, key=lambda p: median(samples[p]))
+  lo, hi = bootstrap_ci(samples[best], args.confidence)
+  # Every period we measured whose interval overlaps the winner's.
+  close = [p for p in samples if samples[p]
+           and bootstrap_ci(samples[p], args.confidence)[0] <= hi]
+  return best, samples[best], (lo, hi), (min(close), max(close)), spent
+
+def main():
+  parser = ArgumentParser(
+    description='Search for the best upthread-juggle preemption period '
+                'for a fixedwork configuration.')
+  parser.add_argument('--exec', default='./upthread-juggle-fixedwork',
+                      help='fixedwork binary to tune')
+  parser.add_argument('--threads', type=int, default=1024)
+  parser.add_argument('--loops', type=int, default=300000)
+  parser.add_argument('--fake-work', type=int, default=1000)
+  parser.add_argument('--work-dist', default='fixed')
+  parser.add_argument('--delay-dist', default='none')
+  parser.add_argument('--objective', choices=['makespan', 'tail'],
+                      default='makespan',
+                      help='minimize the program run, or the --tail '
+                           'percentile of thread completion times')
+  parser.add_argument('--tail', type=float, default=99.0)
+  parser.add_argument('--min-period', type=int, default=1000,
+                      help='shortest period to try, in us')
+  parser.add_argument('--max-period', type=int, default=1000000,
+                      help='longest period to try, in us')
+  parser.add_argument('--points', type=int, default=16,
+                      help='candidate periods to start with')
+  parser.add_argument('--initial-runs', type=int, default=2,
+                      help='runs per candidate in the first round')
+  parser.add_argument('--eta', type=int, default=2,
+                      help='keep the best 1/eta each round')
+  parser.add_argument('--max-runs', type=int, default=200,
+                      help='total runs to spend at most')
+  parser.add_argument('--min-runs', type=int, default=4,
+                      help='runs a candidate needs before it can be dropped '
+                           'for its confidence interval')
+  parser.add_argument('--confidence', type=float, default=0.95)
+  parser.add_argument('--noisy-retries', type=int, default=3,
+                      help='times to rerun a run flagged as noisy')
+  parser.add_argument('--quiet', '-q', action='store_true')
+  args = parser.parse_args()
+  if args.points < 2 or args.eta < 2 or args.min_period >= args.max_period:
+    parser.error('need at least 2 points, eta >= 2 and min < max period')
+
+  best, xs, (lo, hi), (plo, phi), spent = tune(args)
+  what = 'makespan' if args.objective == 'makespan' \
+         else 'p%g completion time' % args.tail
+  print("best preempt period: %dus" % best)
+  print("  %s: median %.1fms, %d%% CI [%.1fms, %.1fms] over %d runs" %
+        (what, median(xs), round(args.confidence * 100), lo, hi, len(xs)))
+  print("  indistinguishable periods: %dus - %dus" % (plo, phi))
+  print("  total runs: %d" % spent)
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,308 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Memory footprint of lots of mostly idle threads.  We ramp the thread count
+ * from 'start_threads' up to 'max_threads', doubling at each step.  At each
+ * step, the new threads are created and park on a condition variable, and we
+ * measure:
+ *
+ *   - how long each creation took
+ *   - the resident set and the page faults taken since the last step
+ *   - yield throughput with every thread woken to pthread_yield() for
+ *     'yield_ms' milliseconds before parking again
+ *
+ * If a creation fails, we report the last step that worked and stop there.
+ *
+ * Stacks are 'stack_kb' KB and come in three kinds:
+ *
+ *   default - whatever the library does for a stack of that size
+ *   noguard - no guard page below the stack
+ *   huge    - stacks we mmap ourselves, backed by huge pages if the kernel
+ *             has any reserved (MAP_HUGETLB), and transparent huge pages
+ *             otherwise.  These come in whole huge pages, so stack_kb has to
+ *             be a multiple of 2048
+ *
+ * Upthreads only take a stack size, so noguard and huge are native pthreads
+ * only.  Going past a few tens of thousands of native threads usually means
+ * raising ulimit -u, kernel.threads-max and vm.max_map_count first.
+ *
+ * usage: footprint [max_threads] [start_threads] [stack_kb] [stack_kind]
+ *                  [yield_ms] [human] [preempt_period] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../libconfig.h"
+#include "../results.h"
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* Modifiable via command line */
+int max_threads = 131072;
+int start_threads = 1024;
+int stack_kb = 64;
+char *stack_kind = "default";
+int yield_ms = 100;
+int human = 1;
+int preempt_period = PREEMPT_PERIOD;
+
+static pthread_t *thandles;
+static pthread_mutex_t lock;
+static pthread_cond_t wake;
+static int parked;
+static uint64_t generation;
+static volatile bool stopping;
+static volatile uint64_t yield_end;
+static uint64_t total_yields;
+
+/* Park until the next generation, then yield until yield_end. */
+static void *footprint_thread(void *arg)
+{
+	/* Threads created in a later step start out in that step's generation. */
+	pthread_mutex_lock(&lock);
+	uint64_t gen = generation;
+	while (1) {
+		parked++;
+		while (generation == gen)
+			pthread_cond_wait(&wake, &lock);
+		gen = generation;
+		pthread_mutex_unlock(&lock);
+		if (stopping)
+			return NULL;
+
+		uint64_t yields = 0;
+		while (read_tsc() < yield_end) {
+			pthread_yield();
+			yields++;
+		}
+		__sync_fetch_and_add(&total_yields, yields);
+		pthread_mutex_lock(&lock);
+	}
+}
+
+static void wait_parked(int nr_threads)
+{
+	while (1) {
+		pthread_mutex_lock(&lock);
+		int n = parked;
+		pthread_mutex_unlock(&lock);
+		if (n == nr_threads)
+			return;
+		pthread_yield();
+	}
+}
+
+/* Start a new generation: everyone wakes up and runs until they see
+ * 'stopping' or yield_end passes. */
+static void wake_all(void)
+{
+	pthread_mutex_lock(&lock);
+	parked = 0;
+	generation++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+}
+
+#ifdef USE_PTHREAD
+static void *alloc_huge_stack(size_t size)
+{
+	size = roundup(size, HUGE_PAGE_SIZE);
+	void *stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_STACK,
+	                   -1, 0);
+	if (stack != MAP_FAILED)
+		return stack;
+	stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+	madvise(stack, size, MADV_HUGEPAGE);
+	return stack;
+}
+#endif
+
+static int create_thread(int i)
+{
+	pthread_attr_t attr;
+	size_t size = (size_t)stack_kb * 1024;
+
+	pthread_attr_init(&attr);
+#ifdef USE_PTHREAD
+	if (!strcmp(stack_kind, "huge")) {
+		void *stack = alloc_huge_stack(size);
+		if (!stack)
+			return -1;
+		pthread_attr_setstack(&attr, stack, roundup(size, HUGE_PAGE_SIZE));
+	} else {
+		pthread_attr_setstacksize(&attr, size);
+		if (!strcmp(stack_kind, "noguard"))
+			pthread_attr_setguardsize(&attr, 0);
+	}
+#else
+	pthread_attr_setstacksize(&attr, size);
+#endif
+	return pthread_create(&thandles[i], &attr, footprint_thread, NULL);
+}
+
+/* Resident set size in KB. */
+static uint64_t rss_kb(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	if (argc > 1)
+		max_threads = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		start_threads = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		stack_kb = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		stack_kind = argv[4];
+	if (argc > 5)
+		yield_ms = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		human = strtol(argv[6], 0, 10);
+	if (argc > 7)
+		preempt_period = strtol(argv[7], 0, 10);
+
+	if (strcmp(stack_kind, "default") && strcmp(stack_kind, "noguard")
+	    && strcmp(stack_kind, "huge")) {
+		fprintf(stderr, "Unknown stack kind: %s\n", stack_kind);
+		exit(1);
+	}
+#ifndef USE_PTHREAD
+	if (strcmp(stack_kind, "default")) {
+		fprintf(stderr, "Upthreads only take a stack size, "
+		                "using default stacks\n");
+		stack_kind = "default";
+	}
+#endif
+	/* Anything else would be rounded up behind the records' backs. */
+	if (!strcmp(stack_kind, "huge") && (stack_kb * 1024UL) % HUGE_PAGE_SIZE) {
+		fprintf(stderr, "Huge stacks have to be a multiple of %luKB, "
+		                "not %dKB\n", HUGE_PAGE_SIZE / 1024, stack_kb);
+		exit(1);
+	}
+	start_threads = MAX(MIN(start_threads, max_threads), 1);
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	results_init("footprint", argc, argv);
+
+	thandles = calloc(max_threads, sizeof(pthread_t));
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+
+	/* Do any library specific test prep */
+	test_prep();
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	uint64_t rss_base = rss_kb();
+	long minflt = ru.ru_minflt, majflt = ru.ru_majflt;
+	if (human)
+		printf("Thread footprint, %s %dKB stacks, base rss: %ldKB\n",
+		       stack_kind, stack_kb, rss_base);
+
+	int nr_threads = 0;
+	bool failed = false;
+	for (int target = start_threads; !failed; target *= 2) {
+		target = MIN(target, max_threads);
+		int prev = nr_threads;
+
+		uint64_t create_beg = read_tsc();
+		for (; nr_threads < target; nr_threads++) {
+			if (create_thread(nr_threads)) {
+				failed = true;
+				break;
+			}
+		}
+		uint64_t create_tsc = read_tsc() - create_beg;
+		if (nr_threads == prev)
+			break;
+		wait_parked(nr_threads);
+
+		/* Everyone's created and parked: see what they cost us. */
+		uint64_t rss = rss_kb();
+		getrusage(RUSAGE_SELF, &ru);
+		long step_minflt = ru.ru_minflt - minflt;
+		long step_majflt = ru.ru_majflt - majflt;
+		minflt = ru.ru_minflt;
+		majflt = ru.ru_majflt;
+
+		total_yields = 0;
+		uint64_t yield_beg = read_tsc();
+		yield_end = yield_beg + usec2tsc((uint64_t)yield_ms * 1000);
+		wake_all();
+		wait_parked(nr_threads);
+		uint64_t yield_tsc = read_tsc() - yield_beg;
+
+		uint64_t create_ns = tsc2nsec(create_tsc) / (nr_threads - prev);
+		uint64_t per_thread_kb = (rss - rss_base) / nr_threads;
+		uint64_t yields_per_sec = total_yields * get_tsc_freq() / yield_tsc;
+		uint64_t threads_per_gb = rss > rss_base
+		                        ? (uint64_t)nr_threads * 1024 * 1024
+		                          / (rss - rss_base) : 0;
+		if (human) {
+			printf("  %7d threads: create %6ldns/thread, rss %8ldKB "
+			       "(%ldKB/thread, %ld threads/GB), faults %ld minor %ld major, "
+			       "%ld yields/s\n",
+			       nr_threads, create_ns, rss, per_thread_kb, threads_per_gb,
+			       step_minflt, step_majflt, yields_per_sec);
+		} else {
+			printf("%d:%d:%s:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld\n",
+			       nr_threads, stack_kb, stack_kind, get_tsc_freq(),
+			       create_tsc, rss_base, rss, step_minflt, step_majflt,
+			       total_yields, yield_tsc);
+		}
+
+		struct result r;
+		result_begin(&r, stack_kind);
+		result_param_int(&r, "nr_threads", nr_threads);
+		result_param_int(&r, "stack_kb", stack_kb);
+		result_param_int(&r, "yield_ms", yield_ms);
+		result_param_int(&r, "preempt_period", preempt_period);
+		result_metric_int(&r, "tsc_freq", get_tsc_freq());
+		result_metric_int(&r, "beg", yield_beg);
+		result_metric_int(&r, "end", yield_beg + yield_tsc);
+		result_metric_int(&r, "count", total_yields);
+		result_metric_int(&r, "create_ns_per_thread", create_ns);
+		result_metric_int(&r, "rss_base_kb", rss_base);
+		result_metric_int(&r, "rss_kb", rss);
+		result_metric_int(&r, "rss_per_thread_kb", per_thread_kb);
+		result_metric_int(&r, "minflt", step_minflt);
+		result_metric_int(&r, "majflt", step_majflt);
+		result_end(&r);
+
+		if (nr_threads == max_threads)
+			break;
+	}
+	if (failed)
+		fprintf(stderr, "Thread creation failed after %d threads\n",
+		        nr_threads);
+
+	stopping = true;
+	wake_all();
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(thandles[i], NULL);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* Log-linear latency histograms: 2^HIST_SUB_BITS linear buckets per power of
+ * two, so any value is within ~6% of its bucket.  Cheap enough to update in a
+ * measured loop, and per-thread histograms can just be added together. */
+
+#ifndef BENCHMARKS_HISTOGRAM_H
+#define BENCHMARKS_HISTOGRAM_H
+
+#include <stdint.h>
+#include <sys/param.h> /* MAX */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_MASK ((1 << HIST_SUB_BITS) - 1)
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t samples;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(uint64_t v)
+{
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+	int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & HIST_SUB_MASK);
+}
+
+/* The smallest value that lands in bucket b. */
+static inline uint64_t hist_value(int b)
+{
+	if (b < (1 << HIST_SUB_BITS))
+		return b;
+	int shift = (b >> HIST_SUB_BITS) - 1;
+	return (uint64_t)((1 << HIST_SUB_BITS) | (b & HIST_SUB_MASK)) << shift;
+}
+
+static inline void hist_add(struct histogram *h, uint64_t v)
+{
+	h->samples++;
+	h->sum += v;
+	h->max = MAX(h->max, v);
+	h->hist[hist_bucket(v)]++;
+}
+
+static inline void hist_merge(struct histogram *to, struct histogram *from)
+{
+	to->samples += from->samples;
+	to->sum += from->sum;
+	to->max = MAX(to->max, from->max);
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		to->hist[b] += from->hist[b];
+}
+
+/* The value below which p percent of the samples fall. */
+static inline uint64_t hist_percentile(struct histogram *h, double p)
+{
+	uint64_t want = (uint64_t)(p * h->samples / 100.0), seen = 0;
+	if (!h->samples)
+		return 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->hist[b];
+		if (seen > want)
+			return hist_value(b);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static inline uint64_t hist_mean(struct histogram *h)
+{
+	return h->samples ? h->sum / h->samples : 0;
+}
+
+#endif /* BENCHMARKS_HISTOGRAM_H */
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* OS noise detection.  When JITTER_CPUS is set in the environment (a list or
+ * range of cpus, like "14,15" or "12-15"), jitter_init() forks one sampler
+ * process per cpu, pinned there, that spins reading the tsc.  Any gap between
+ * two reads longer than JITTER_THRESHOLD ns (default 1000) means something
+ * else ran on that cpu, and goes into a histogram.  Between jitter_begin()
+ * and jitter_end(), the samplers add up the time stolen this way, and
+ * jitter_end() returns true if any cpu lost more than JITTER_LIMIT percent
+ * (default 1) of the window:
+ *
+ *   jitter_init();              before any threads are up
+ *   jitter_begin();
+ *   ... run the test ...
+ *   if (jitter_end())
+ *       ... the run was noisy ...
+ *
+ * Each window writes a "jitter" record per cpu, and a noisy one marks the
+ * results recorded after it noisy (see results_set_noisy()) until the next
+ * window ends, so tools/results.py leaves them out.  The samplers are
+ * processes rather than threads so they work the same under every thread
+ * library.  Give them cpus the benchmark isn't using: a sampler sharing a
+ * core with a worker only measures the worker.  Benchmarks that don't place
+ * their own threads call jitter_reserve_cpus() before test_prep() to stay
+ * off the samplers' cpus. */
+
+#ifndef BENCHMARKS_JITTER_H
+#define BENCHMARKS_JITTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "histogram.h"
+#include "topology.h"
+#include "results.h"
+
+#define JITTER_EXIT ((uint64_t)-1)
+
+struct jitter_cpu {
+	int cpu;
+	volatile uint64_t ack;
+	uint64_t beg;
+	uint64_t end;
+	uint64_t stolen;
+	struct histogram hist;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct {
+	int nr_cpus;
+	pid_t *pids;
+	uint64_t threshold_ns;
+	uint64_t threshold;
+	double limit;
+	volatile uint64_t *cmd;
+	uint64_t seq;
+	struct jitter_cpu *cpus;
+} jitter;
+
+static inline bool jitter_enabled(void)
+{
+	return jitter.nr_cpus > 0;
+}
+
+/* Commands are odd to start a window and even to end one, so every window
+ * gets a fresh pair and the samplers can tell them apart. */
+static void __jitter_sample(struct jitter_cpu *j, pid_t parent)
+{
+	uint64_t cmd = 0;
+	bool running = false;
+
+	/* Don't outlive a benchmark that crashes, including one that died
+	 * before the prctl() took. */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != parent)
+		_exit(0);
+
+	pin_to_core(j->cpu);
+	uint64_t last = read_tsc();
+	while (1) {
+		uint64_t now = read_tsc();
+		if (running && now - last > jitter.threshold) {
+			j->stolen += now - last;
+			hist_add(&j->hist, tsc2nsec(now - last));
+		}
+		last = now;
+		if (*jitter.cmd == cmd)
+			continue;
+		cmd = *jitter.cmd;
+		if (cmd == JITTER_EXIT)
+			_exit(0);
+		running = cmd & 1;
+		if (running) {
+			j->stolen = 0;
+			memset(&j->hist, 0, sizeof(j->hist));
+			j->beg = now;
+		} else {
+			j->end = now;
+		}
+		cmb();
+		j->ack = cmd;
+		last = read_tsc();
+	}
+}
+
+static void __jitter_command(uint64_t cmd)
+{
+	*jitter.cmd = cmd;
+	for (int i = 0; i < jitter.nr_cpus; i++)
+		while (jitter.cpus[i].ack != cmd)
+			sched_yield();
+}
+
+static void jitter_exit(void)
+{
+	if (!jitter_enabled())
+		return;
+	*jitter.cmd = JITTER_EXIT;
+	for (int i = 0; i < jitter.nr_cpus; i++)
+		waitpid(jitter.pids[i], NULL, 0);
+	jitter.nr_cpus = 0;
+}
+
+static void jitter_init(void)
+{
+	char *spec = getenv("JITTER_CPUS");
+	char *env;
+	if (!spec || !*spec)
+		return;
+
+	jitter.threshold_ns = (env = getenv("JITTER_THRESHOLD"))
+	                      ? strtol(env, 0, 10) : 1000;
+	jitter.threshold = nsec2tsc(jitter.threshold_ns);
+	jitter.limit = (env = getenv("JITTER_LIMIT")) ? strtod(env, 0) : 1.0;
+
+	/* Same list syntax the benchmarks take for their sweeps. */
+	int *cpus = NULL, n = 0;
+	char *s = strdup(spec);
+	for (char *tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		char *end;
+		int lo = strtol(tok, &end, 10);
+		int hi = *end == '-' ? strtol(end + 1, 0, 10) : lo;
+		if (hi < lo) {
+			fprintf(stderr, "Bad range in JITTER_CPUS: %s\n", tok);
+			exit(1);
+		}
+		cpus = realloc(cpus, sizeof(int) * (n + hi - lo + 1));
+		for (int i = lo; i <= hi; i++)
+			cpus[n++] = i;
+	}
+	free(s);
+
+	/* Shared with the samplers: the command word, then one line per cpu. */
+	size_t size = ARCH_CL_SIZE + sizeof(struct jitter_cpu) * n;
+	void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("jitter_init");
+		exit(1);
+	}
+	jitter.cmd = shared;
+	jitter.cpus = shared + ARCH_CL_SIZE;
+	jitter.pids = calloc(n, sizeof(pid_t));
+
+	/* Make sure nothing buffered gets flushed twice. */
+	fflush(NULL);
+	pid_t parent = getpid();
+	for (int i = 0; i < n; i++) {
+		jitter.cpus[i].cpu = cpus[i];
+		jitter.pids[i] = fork();
+		if (jitter.pids[i] == 0)
+			__jitter_sample(&jitter.cpus[i], parent);
+		if (jitter.pids[i] < 0) {
+			perror("jitter_init: fork");
+			exit(1);
+		}
+		jitter.nr_cpus++;
+	}
+	free(cpus);
+	atexit(jitter_exit);
+}
+
+/* Keep the benchmark off the samplers' cpus.  Under pthreads that means
+ * taking them out of the process's affinity mask, which every thread created
+ * after this inherits.  Under upthreads vcore i runs on cpu i, so the
+ * samplers have to be on the highest cpus, and test_prep() leaves those
+ * vcores out of its request. */
+static inline void jitter_reserve_cpus(void)
+{
+	if (!jitter_enabled())
+		return;
+#ifdef USE_PTHREAD
+	cpu_set_t c;
+	sched_getaffinity(0, sizeof(c), &c);
+	for (int i = 0; i < jitter.nr_cpus; i++)
+		CPU_CLR(jitter.cpus[i].cpu, &c);
+	if (CPU_COUNT(&c) == 0) {
+		fprintf(stderr, "JITTER_CPUS leaves no cpus to run on\n");
+		exit(1);
+	}
+	sched_setaffinity(0, sizeof(c), &c);
+#else
+	int nr_vcores = max_vcores() - jitter.nr_cpus;
+	for (int i = 0; i < jitter.nr_cpus; i++) {
+		if (jitter.cpus[i].cpu < nr_vcores || nr_vcores < 1) {
+			fprintf(stderr, "JITTER_CPUS must be the highest %d cpus, so "
+			        "the vcores can stay off them\n", jitter.nr_cpus);
+			exit(1);
+		}
+	}
+	test_vcores = nr_vcores;
+#endif
+}
+
+static void jitter_begin(void)
+{
+	if (jitter_enabled())
+		__jitter_command(++jitter.seq * 2 + 1);
+}
+
+/* The percentage of the window the noisiest cpu lost. */
+static double jitter_stolen_pct(void)
+{
+	double worst = 0;
+	for (int i = 0; i < jitter.nr_cpus; i++) {
+		struct jitter_cpu *j = &jitter.cpus[i];
+		if (j->end > j->beg)
+			worst = MAX(worst, 100.0 * j->stolen / (j->end - j->beg));
+	}
+	return worst;
+}
+
+/* Close the window and record what the samplers saw, returning true if it
+ * was too noisy to trust. */
+static bool jitter_end(void)
+{
+	if (!jitter_enabled())
+		return false;
+	__jitter_command(jitter.seq * 2);
+	results_set_noisy(false);
+
+	double worst = jitter_stolen_pct();
+	bool noisy = worst > jitter.limit;
+	for (int i = 0; i < jitter.nr_cpus && results_enabled(); i++) {
+		struct jitter_cpu *j = &jitter.cpus[i];
+		struct result r;
+		result_begin(&r, "jitter");
+		result_param_int(&r, "cpu", j->cpu);
+		result_param_int(&r, "threshold_ns", jitter.threshold_ns);
+		result_metric_int(&r, "tsc_freq", get_tsc_freq());
+		result_metric_int(&r, "beg", j->beg);
+		result_metric_int(&r, "end", j->end);
+		result_metric_int(&r, "count", j->hist.samples);
+		result_metric_int(&r, "stolen_ns", tsc2nsec(j->stolen));
+		result_metric_double(&r, "stolen_pct", j->end > j->beg
+		                     ? 100.0 * j->stolen / (j->end - j->beg) : 0);
+		result_metric_int(&r, "max_ns", j->hist.max);
+		result_metric_int(&r, "p50_ns", hist_percentile(&j->hist, 50));
+		result_metric_int(&r, "p99_ns", hist_percentile(&j->hist, 99));
+		result_end(&r);
+	}
+	if (noisy)
+		fprintf(stderr, "Noisy run: a jitter sampler lost %.2f%% of its cpu "
+		                "(limit %.2f%%)\n", worst, jitter.limit);
+	results_set_noisy(noisy);
+	return noisy;
+}
+
+static void jitter_report(FILE *f)
+{
+	for (int i = 0; i < jitter.nr_cpus; i++) {
+		struct jitter_cpu *j = &jitter.cpus[i];
+		fprintf(f, "  Jitter cpu %2d: %ld hiccups, stolen %.3f%%, "
+		        "p50 %ldns, p99 %ldns, max %ldns\n", j->cpu, j->hist.samples,
+		        j->end > j->beg ? 100.0 * j->stolen / (j->end - j->beg) : 0,
+		        hist_percentile(&j->hist, 50), hist_percentile(&j->hist, 99),
+		        j->hist.max);
+	}
+}
+
+#endif /* BENCHMARKS_JITTER_H */
@@ -28,7 +28,14 @@
 #define PREEMPT_PERIOD 10000
 #endif
 
+#ifdef WITH_YIELD
+	#define LIB_SUFFIX "-yield"
+#else
+	#define LIB_SUFFIX ""
+#endif
+
 #ifdef USE_PTHREAD
+	#define LIB_NAME "native-pthread"
 	void calibrate_all_tscs();
 	#include <pthread.h>
 	#define test_prep() \
@@ -38,27 +45,38 @@
 	#define udelay usleep
 	#define vcore_request(n)
 #elif USE_UPTHREAD | USE_UPTHREAD_JUGGLE | USE_UPTHREAD_PVCQ
+	/* How many vcores test_prep() sets up, if not all of them.  Vcore i
+	 * runs on cpu i, so this keeps the top cpus free (see ../jitter.h). */
+	static int test_vcores __attribute__((unused));
+	#define __test_vcores() (test_vcores ? test_vcores : max_vcores())
 	#if USE_UPTHREAD
+		#define LIB_NAME "upthread" LIB_SUFFIX
 		#include <upthread/upthread.h>
-		#define test_prep()
+		#define test_prep() \
+		{ \
+			if (test_vcores) \
+				upthread_set_num_vcores(test_vcores); \
+		}
 	#elif USE_UPTHREAD_PVCQ
+		#define LIB_NAME "upthread-pvcq" LIB_SUFFIX
 		#include <upthread-pvcq/upthread.h>
 		#define test_prep() \
 		{ \
 			upthread_can_vcore_request(false); \
 			upthread_can_vcore_steal(false); \
-			upthread_set_num_vcores(max_vcores()); \
-			vcore_request(max_vcores() - 1); \
+			upthread_set_num_vcores(__test_vcores()); \
+			vcore_request(__test_vcores() - 1); \
 		}
 	#elif USE_UPTHREAD_JUGGLE
+		#define LIB_NAME "upthread-juggle"
 		#include <upthread-juggle/upthread.h>
 		#define test_prep() \
 		{ \
 			upthread_can_vcore_request(false); \
 			upthread_can_vcore_steal(false); \
-			upthread_set_num_vcores(max_vcores()); \
+			upthread_set_num_vcores(__test_vcores()); \
 			upthread_set_sched_period(preempt_period); \
-			vcore_request(max_vcores() - 1); \
+			vcore_request(__test_vcores() - 1); \
 		}
 	#endif
 	#include <parlib/parlib.h>
@@ -66,6 +84,18 @@
 	#define pthread_t upthread_t
 	#define pthread_create upthread_create
 	#define pthread_join upthread_join
+	#define pthread_attr_t upthread_attr_t
+	#define pthread_attr_init upthread_attr_init
+	#define pthread_attr_setstacksize upthread_attr_setstacksize
+	#define pthread_mutex_t upthread_mutex_t
+	#define pthread_mutex_init upthread_mutex_init
+	#define pthread_mutex_lock upthread_mutex_lock
+	#define pthread_mutex_unlock upthread_mutex_unlock
+	#define pthread_cond_t upthread_cond_t
+	#define pthread_cond_init upthread_cond_init
+	#define pthread_cond_wait upthread_cond_wait
+	#define pthread_cond_signal upthread_cond_signal
+	#define pthread_cond_broadcast upthread_cond_broadcast
 	#define calibrate_all_tscs()
 	#define pthread_id() (upthread_self()->id)
 #endif
@@ -1,5 +1,4 @@
-#!/usr/bin/env python
-####!/usr/bin/arch -i386 python2.7
+#!/usr/bin/env python3
 #
 # Author: Kevin Klues <klueska@cs.berkeley.edu>
 
@@ -1,4 +1,4 @@
-#!/usr/bin/arch -i386 python2.7
+#!/usr/bin/env python3
 #
 # Author: Kevin Klues <klueska@cs.berkeley.edu>
 
@@ -12,87 +12,109 @@ matplotlib.use('Agg')
 from pylab import *
 from collections import OrderedDict
 import numpy as np
-import pprint
 import matplotlib.ticker as ticker
 
+# Bump whenever NAS_DTYPE changes, to throw away old caches.
+CACHE_VERSION = 1
+CACHE_FILE = '.nas-cache.npz'
+
+# One per NPB run found in the logs.  Metrics a run didn't print are NaN.
+NAS_DTYPE = np.dtype([
+  ('lib', 'U32'),
+  ('ncores', np.int64),
+  ('test', 'U16'),
+  ('class', 'U4'),
+  ('time', np.float64),
+  ('mops', np.float64),
+  ('mopspt', np.float64),
+])
+
 class BenchmarkData:
+  """results holds one NAS_DTYPE record per run of each test."""
   def __init__(self, config):
     input_folder = config.input_folder
-    self.files = glob.glob(input_folder + '/*.dat')
-    self.data = {}
-    map(lambda x: FileData(x, self), self.files)
-
-class FileData:
-  def __init__(self, f, bdata):
-    self.file_name = os.path.basename(f)
-    m = re.match('(?P<lib>.*)-(?P<test>.*)-(?P<class>.*)-(?P<ncores>.*)-(?P<iters>.*).dat', self.file_name)
-    self.lib = m.group('lib')
-    self.ncores = int(m.group('ncores'))
-    lines = file(f).readlines()
-
-    # Set the data in the parent object
-    bdata.data.setdefault(self.lib, {})
-    bdata.data[self.lib].setdefault(self.ncores, {})
-
-    # Build a regex for breaking the test into parts
-    regex = re.compile("^bin\/(?P<test>.*)\.(?P<class>.*)\..*$")
-
-    # Strip out all the compile stuff
-    startline = 0
-    test = ""
-    for i, l in enumerate(lines):
-      m = regex.search(l)
-      if m:
-        test = m.group('test')
-        startline = i
-        break
-
-    # Break the file into individual tests
-    testlines = {}
-    for i, l in enumerate(lines):
-      m = regex.search(l)
+    self.files = sorted(glob.glob(input_folder + '/*.dat'))
+    cache = os.path.join(input_folder, CACHE_FILE)
+    self.results = self.load_cache(cache)
+    if self.results is None:
+      rows = []
+      for f in self.files:
+        rows.extend(parse_file(f))
+      self.results = np.array(rows, dtype=NAS_DTYPE)
+      self.save_cache(cache)
+
+  def stamps(self):
+    return np.array([[os.path.getmtime(f), os.path.getsize(f)]
+                     for f in self.files], dtype=np.float64).reshape(-1, 2)
+
+  def load_cache(self, cache):
+    """The cached results, if they came from exactly these .dat files."""
+    if not os.path.exists(cache):
+      return None
+    with np.load(cache) as c:
+      if (int(c['version']) != CACHE_VERSION
+          or list(c['files']) != [os.path.basename(f) for f in self.files]
+          or not np.array_equal(c['stamps'], self.stamps())):
+        return None
+      return c['results']
+
+  def save_cache(self, cache):
+    try:
+      np.savez(cache, version=np.array(CACHE_VERSION),
+               files=np.array([os.path.basename(f) for f in self.files]),
+               stamps=self.stamps(), results=self.results)
+    except (IOError, OSError) as e:
+      print("warning: can't cache results in %s: %s" % (cache, e))
+
+# The graphs compare 'native' against 'upthread'.
+LIB_ALIASES = {'native-pthread': 'native'}
+
+def parse_file(f):
+  file_name = os.path.basename(f)
+  m = re.match(r'(?P<lib>.*)-(?P<test>.*)-(?P<class>.*)-(?P<ncores>.*)-(?P<iters>.*)\.dat', file_name)
+  # nas-npb/run-nas names the native runs after their Makefrag library.
+  lib = LIB_ALIASES.get(m.group('lib'), m.group('lib'))
+  ncores = int(m.group('ncores'))
+  lines = open(f).readlines()
+
+  # Each run starts with its "bin/<test>.<class>.x" line; everything before
+  # the first one is compile output.
+  regex = re.compile(r"^bin\/(?P<test>.*)\.(?P<class>.*)\..*$")
+  tregex = re.compile(r"^\s*Time in seconds\s*=\s*(?P<val>.*)$")
+  mregex = re.compile(r"^\s*Mop/s total\s*=\s*(?P<val>.*)$")
+  mptregex = re.compile(r"^\s*Mop/s/thread\s*=\s*(?P<val>.*)$")
+  rows = []
+  row = None
+  for l in lines:
+    m = regex.search(l)
+    if m:
+      row = [lib, ncores, m.group('test'), m.group('class'),
+             np.nan, np.nan, np.nan]
+      rows.append(row)
+      continue
+    if row is None:
+      continue
+    for i, r in ((4, tregex), (5, mregex), (6, mptregex)):
+      m = r.search(l)
       if m:
-        testlines.setdefault(test, [])
-        testlines[test].append(lines[startline:i])
-        test = m.group('test')
-        startline = i
-    testlines.setdefault(test, [])
-    testlines[test].append(lines[startline:])
-
-    # Parse each set of tests
-    tregex = re.compile("^\s*Time in seconds\s*=\s*(?P<time>.*)$")
-    mregex = re.compile("^\s*Mop/s total\s*=\s*(?P<mops>.*)$")
-    mptregex = re.compile("^\s*Mop/s/thread\s*=\s*(?P<mopspt>.*)$")
-    tdata = bdata.data[self.lib][self.ncores]
-    for t in testlines.keys():
-        for test in testlines[t]:
-            tdata.setdefault(t, {})
-            for l in test:
-                m = tregex.search(l)
-                if m:
-                    tdata[t].setdefault('time', [])
-                    tdata[t]['time'].append(float(m.group('time')))
-                m = mregex.search(l)
-                if m:
-                    tdata[t].setdefault('mops', [])
-                    tdata[t]['mops'].append(float(m.group('mops')))
-                m = mptregex.search(l)
-                if m:
-                    tdata[t].setdefault('mopspt', [])
-                    tdata[t]['mopspt'].append(float(m.group('mopspt')))
+        row[i] = float(m.group('val'))
+  return [tuple(r) for r in rows]
 
-def get_absolute_metrics(bdata, metric):
+def get_avg_metrics(bdata, metric):
+  """avg_metrics[ncores][test][lib], averaged over all runs."""
+  r = bdata.results
   avg_metrics = {}
-  ncores = []
-  for lib in bdata.data:
-    for n in bdata.data[lib]:
-      ncores.append(n) if n not in ncores else None
-      for test in bdata.data[lib][n]:
-        data = bdata.data[lib][n][test][metric]
-        avg_metrics.setdefault(n, {})
-        avg_metrics[n].setdefault(test, {})
-        avg_metrics[n][test][lib] = np.mean(data)
-  ncores.sort()
+  for n in np.unique(r['ncores']):
+    for test in np.unique(r['test']):
+      for lib in np.unique(r['lib']):
+        sel = r[(r['ncores'] == n) & (r['test'] == test) & (r['lib'] == lib)]
+        if len(sel):
+          avg_metrics.setdefault(int(n), {}).setdefault(str(test), {})
+          avg_metrics[int(n)][str(test)][str(lib)] = np.nanmean(sel[metric])
+  return avg_metrics, sorted(avg_metrics)
+
+def get_absolute_metrics(bdata, metric):
+  avg_metrics, ncores = get_avg_metrics(bdata, metric)
   absolute_metric = {}
   for n in avg_metrics:
     for test in avg_metrics[n]:
@@ -111,17 +133,7 @@ def get_absolute_metrics(bdata, metric):
   return [tests, absolute_metrics0, absolute_metrics1]
 
 def get_relative_metrics(bdata, metric):
-  avg_metrics = {}
-  ncores = []
-  for lib in bdata.data:
-    for n in bdata.data[lib]:
-      ncores.append(n) if n not in ncores else None
-      for test in bdata.data[lib][n]:
-        data = bdata.data[lib][n][test][metric]
-        avg_metrics.setdefault(n, {})
-        avg_metrics[n].setdefault(test, {})
-        avg_metrics[n][test][lib] = np.mean(data)
-  ncores.sort()
+  avg_metrics, ncores = get_avg_metrics(bdata, metric)
   relative_metric = {}
   for n in avg_metrics:
     for test in avg_metrics[n]:
@@ -135,6 +147,9 @@ def get_relative_metrics(bdata, metric):
   relative_metrics1 = [ relative_metric[ncores[1]][t] for t in tests ]
   return [tests, relative_metrics0, relative_metrics1]
 
+def legend_handles(leg):
+  return getattr(leg, 'legend_handles', None) or leg.legendHandles
+
 def graph_runtime(bdata, config):
   tests, runtimes0, runtimes1 = get_absolute_metrics(bdata, 'time')
 
@@ -147,7 +162,7 @@ def graph_runtime(bdata, config):
     return p
 
   fig, ax = plt.subplots()
-  axes = [ax] + map(lambda x: ax.twinx(), range(len(tests) - 1))
+  axes = [ax] + [ax.twinx() for x in range(len(tests) - 1)]
   ax = axes[0]
   for i, t in enumerate(tests):
     p0 = axes[i].hlines(runtimes0[i][1], margin + ind[i], margin + ind[i] + (1 - 2*margin), linewidth=8, color=colors[0])
@@ -169,7 +184,7 @@ def graph_runtime(bdata, config):
   for tick in ax.xaxis.get_minor_ticks():
       tick.tick1line.set_markersize(0)
       tick.tick2line.set_markersize(0)
-      tick.label.set_fontsize(18)
+      tick.label1.set_fontsize(18)
   for axis in axes[1:]:
     axis.get_yaxis().set_ticks([])
   ax.get_yaxis().set_ticklabels([0])
@@ -182,7 +197,7 @@ def graph_runtime(bdata, config):
     "upthreads (16 cores)",
   ]
   leg = plt.legend(ps, labels, loc="lower center")
-  for legobj in leg.legendHandles:
+  for legobj in legend_handles(leg):
     legobj.set_linewidth(15.0)
   figname = config.output_folder + "/nas-runtimes.png"
   savefig(figname, bbox_inches="tight")
@@ -216,14 +231,14 @@ def graph_speedup(bdata, config):
   ls = ['Full Hyperthreads (32 cores)', 'No Hyperthreads (16 cores)']
   title('Average Speedup of NAS Parallel Benchmarks', fontsize=20)
   ylabel('Percent Speedup (%)', fontsize=18)
-  yticks(ax.get_yticks(), map(lambda x: "%s%%" % (x*100), ax.get_yticks()), fontsize=18)
+  yticks(ax.get_yticks(), ["%s%%" % (x*100) for x in ax.get_yticks()], fontsize=18)
   ax.xaxis.set_major_formatter(ticker.NullFormatter())
   ax.xaxis.set_minor_locator(ticker.FixedLocator(0.5 + np.arange(len(tests))))
   ax.xaxis.set_minor_formatter(ticker.FixedFormatter(tests))
   for tick in ax.xaxis.get_minor_ticks():
       tick.tick1line.set_markersize(0)
       tick.tick2line.set_markersize(0)
-      tick.label.set_fontsize(18)
+      tick.label1.set_fontsize(18)
   x1,x2,y1,y2 = ax.axis()
   ax.axis((x1,x2,y1,0.85))
   ax.legend([p0, p1], ls, loc='best', fontsize=18)
@@ -245,7 +260,7 @@ def graph_mops(bdata, config):
   ls = ['Full Hyperthreads (32 cores)', 'No Hyperthreads (16 cores)']
   title('Average Speedup of NAS Parallel Benchmarks')
   ylabel('Percent Speedup (%)')
-  yticks(ax.get_yticks(), map(lambda x: "%s%%" % (x*100), ax.get_yticks()))
+  yticks(ax.get_yticks(), ["%s%%" % (x*100) for x in ax.get_yticks()])
   ax.xaxis.set_major_formatter(ticker.NullFormatter())
   ax.xaxis.set_minor_locator(ticker.FixedLocator(0.5 + np.arange(len(tests))))
   ax.xaxis.set_minor_formatter(ticker.FixedFormatter(tests))
@@ -271,7 +286,7 @@ def graph_mopspt(bdata, config):
   ls = ['Full Hyperthreads (32 cores)', 'No Hyperthreads (16 cores)']
   title('Average Speedup of NAS Parallel Benchmarks')
   ylabel('Percent Speedup (%)')
-  yticks(ax.get_yticks(), map(lambda x: "%s%%" % (x*100), ax.get_yticks()))
+  yticks(ax.get_yticks(), ["%s%%" % (x*100) for x in ax.get_yticks()])
   ax.xaxis.set_major_formatter(ticker.NullFormatter())
   ax.xaxis.set_minor_locator(ticker.FixedLocator(0.5 + np.arange(len(tests))))
   ax.xaxis.set_minor_formatter(ticker.FixedFormatter(tests))
@@ -286,7 +301,7 @@ def graph_mopspt(bdata, config):
 def nas_graphs(parser, args):
   config = lambda:None
   if args.config_file:
-    config.__dict__ = json.load(file(args.config_file), object_pairs_hook=OrderedDict)
+    config.__dict__ = json.load(open(args.config_file), object_pairs_hook=OrderedDict)
   else:
     parser.print_help()
     exit(1)
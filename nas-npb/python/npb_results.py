@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Turn NPB console logs into the same JSON Lines records the C benchmarks
+# write to $RESULTS_FILE (see ../../results.h), one per run:
+#
+#   npb_results.py data/upthread-bt-C-16-1.dat >> data/results.jsonl
+#
+# Logs are named lib-test-class-ncores-iter.dat, like nas_graphs.py expects.
+
+from __future__ import print_function
+import os
+import re
+import sys
+import json
+import time
+import socket
+import platform
+import multiprocessing
+
+SCHEMA = 1
+
+FIELDS = {
+  'Time in seconds': ('metrics', 'time_s', float),
+  'Mop/s total': ('metrics', 'mops', float),
+  'Mop/s/thread': ('metrics', 'mops_per_thread', float),
+  'Iterations': ('params', 'iterations', int),
+  'Total threads': ('params', 'threads', int),
+}
+
+def machine():
+  cpu = ''
+  try:
+    for l in open('/proc/cpuinfo'):
+      if l.startswith('model name'):
+        cpu = l.split(':', 1)[1].strip()
+        break
+  except IOError:
+    pass
+  u = platform.uname()
+  return {'host': socket.gethostname(), 'kernel': u[2] + ' ' + u[3],
+          'arch': u[4], 'cpu': cpu,
+          'nr_cpus': multiprocessing.cpu_count(), 'tsc_freq': 0}
+
+def parse(path):
+  """One record per "Benchmark Completed" block in the log."""
+  name = os.path.basename(path)
+  m = re.match(r'(?P<lib>.*)-(?P<test>.*)-(?P<class>.*)-(?P<ncores>.*)-(?P<iters>.*)\.dat', name)
+  if not m:
+    print("%s: not named lib-test-class-ncores-iter.dat" % path,
+          file=sys.stderr)
+    return []
+  records = []
+  record = None
+  libgomp = None
+  for l in open(path):
+    # run-nas notes which libgomp the binary resolved to up top.
+    if l.startswith('libgomp:'):
+      libgomp = l.split(':', 1)[1].strip() or None
+      continue
+    if 'Benchmark Completed' in l:
+      record = {'library': m.group('lib'), 'test': m.group('test'),
+                'params': {'class': m.group('class'),
+                           'ncores': int(m.group('ncores'))},
+                'metrics': {}}
+      if libgomp:
+        record['libgomp'] = libgomp
+      records.append(record)
+      continue
+    if record is None or '=' not in l:
+      continue
+    key, val = [s.strip() for s in l.split('=', 1)]
+    if key in FIELDS:
+      section, field, conv = FIELDS[key]
+      try:
+        record[section][field] = conv(val)
+      except ValueError:
+        pass
+    elif key == 'Verification':
+      record['metrics']['verified'] = int(val == 'SUCCESSFUL')
+  return records
+
+def main():
+  if len(sys.argv) < 2:
+    print("usage: %s log.dat..." % sys.argv[0], file=sys.stderr)
+    return 1
+  mach = machine()
+  for n, path in enumerate(sys.argv[1:]):
+    # Each log is its own run.
+    run_id = "%s-%d-%d-%d" % (mach['host'], int(time.time()), os.getpid(), n)
+    for r in parse(path):
+      record = {'schema': SCHEMA, 'run_id': run_id, 'time': int(time.time()),
+                'benchmark': 'npb', 'machine': mach,
+                'cmdline': 'bin/%s.%s.x' % (r['test'], r['params']['class'])}
+      record.update(r)
+      print(json.dumps(record, sort_keys=True))
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
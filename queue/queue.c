@@ -0,0 +1,492 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Producer/consumer queue throughput and latency.  Producers enqueue their
+ * current tsc for 'duration' seconds, and consumers dequeue and record how
+ * long each item sat in the queue.  Queues:
+ *
+ *   mutex - a bounded ring under a mutex, with condition variables to block
+ *           on when it is empty or full
+ *   spsc  - lock-free single producer/single consumer rings, one per
+ *           producer/consumer pair (so nr_producers must be nr_consumers)
+ *   mpmc  - Dmitry Vyukov's bounded lock-free multi producer/multi consumer
+ *           queue
+ *
+ * With the lock-free queues, a thread that finds its queue empty (or full)
+ * either spins or yields, depending on 'wait'.
+ *
+ * usage: queue [type] [nr_producers] [nr_consumers] [duration] [capacity]
+ *              [wait] [human] [preempt_period] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../libconfig.h"
+#include "../barrier.h"
+#include "../topology.h"
+#include "../histogram.h"
+#include "../results.h"
+#include "../cpuusage.h"
+
+enum { QUEUE_MUTEX, QUEUE_SPSC, QUEUE_MPMC };
+enum { WAIT_SPIN, WAIT_YIELD };
+
+/* Modifiable via command line */
+char *type_name = "mpmc";
+int nr_producers = 1;
+int nr_consumers = 1;
+int duration = 5;
+int capacity = 1024;
+char *wait_name = "yield";
+int human = 1;
+int preempt_period = PREEMPT_PERIOD;
+
+static int type;
+static int wait_policy;
+
+struct mutex_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t mask;
+	uint64_t *buf;
+};
+
+struct spsc_queue {
+	uint64_t *buf;
+	uint64_t mask;
+	/* Consumer side, with its cached copy of the producer's tail. */
+	volatile uint64_t head __attribute__((aligned(ARCH_CL_SIZE)));
+	uint64_t tail_cache;
+	/* Producer side, with its cached copy of the consumer's head. */
+	volatile uint64_t tail __attribute__((aligned(ARCH_CL_SIZE)));
+	uint64_t head_cache;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct mpmc_cell {
+	volatile uint64_t seq;
+	uint64_t data;
+};
+
+struct mpmc_queue {
+	struct mpmc_cell *cells;
+	uint64_t mask;
+	volatile uint64_t enqueue_pos __attribute__((aligned(ARCH_CL_SIZE)));
+	volatile uint64_t dequeue_pos __attribute__((aligned(ARCH_CL_SIZE)));
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct tdata {
+	uint64_t items;
+	uint64_t waits;      /* times we found the queue empty (or full) */
+	struct histogram lat;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct mutex_queue mq;
+static struct spsc_queue *spsc;
+static struct mpmc_queue mpmc;
+static struct tdata *producers, *consumers;
+static struct tree_barrier barrier;
+static uint64_t start_tsc, end_tsc;
+static volatile int producers_left;
+
+static void mutex_init(struct mutex_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->head = q->tail = 0;
+	q->mask = capacity - 1;
+	q->buf = malloc(sizeof(uint64_t) * capacity);
+}
+
+static void mutex_push(struct mutex_queue *q, uint64_t v, struct tdata *t)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->tail - q->head == q->mask + 1) {
+		t->waits++;
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->buf[q->tail++ & q->mask] = v;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Returns false once the queue is empty and all the producers are done. */
+static bool mutex_pop(struct mutex_queue *q, uint64_t *v, struct tdata *t)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->tail == q->head) {
+		if (!producers_left) {
+			pthread_mutex_unlock(&q->lock);
+			return false;
+		}
+		t->waits++;
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	*v = q->buf[q->head++ & q->mask];
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return true;
+}
+
+static void spsc_init(struct spsc_queue *q)
+{
+	q->buf = malloc(sizeof(uint64_t) * capacity);
+	q->mask = capacity - 1;
+	q->head = q->tail = 0;
+	q->head_cache = q->tail_cache = 0;
+}
+
+static inline bool spsc_push(struct spsc_queue *q, uint64_t v)
+{
+	uint64_t tail = q->tail;
+	if (tail - q->head_cache > q->mask) {
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->head_cache > q->mask)
+			return false;
+	}
+	q->buf[tail & q->mask] = v;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool spsc_pop(struct spsc_queue *q, uint64_t *v)
+{
+	uint64_t head = q->head;
+	if (head == q->tail_cache) {
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head == q->tail_cache)
+			return false;
+	}
+	*v = q->buf[head & q->mask];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void mpmc_init(struct mpmc_queue *q)
+{
+	q->cells = aligned_alloc(ARCH_CL_SIZE, sizeof(struct mpmc_cell) * capacity);
+	q->mask = capacity - 1;
+	for (int i = 0; i < capacity; i++)
+		q->cells[i].seq = i;
+	q->enqueue_pos = q->dequeue_pos = 0;
+}
+
+/* Each cell's seq says whose turn it is: pos when it's free for the producer
+ * at pos, pos + 1 once that producer has filled it. */
+static inline bool mpmc_push(struct mpmc_queue *q, uint64_t v)
+{
+	struct mpmc_cell *cell;
+	uint64_t pos = q->enqueue_pos;
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&q->enqueue_pos, pos, pos + 1))
+				break;
+			pos = q->enqueue_pos;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = q->enqueue_pos;
+		}
+	}
+	cell->data = v;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool mpmc_pop(struct mpmc_queue *q, uint64_t *v)
+{
+	struct mpmc_cell *cell;
+	uint64_t pos = q->dequeue_pos;
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&q->dequeue_pos, pos, pos + 1))
+				break;
+			pos = q->dequeue_pos;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = q->dequeue_pos;
+		}
+	}
+	*v = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline void backoff(struct tdata *t)
+{
+	t->waits++;
+	if (wait_policy == WAIT_YIELD)
+		pthread_yield();
+	else
+		cpu_relax();
+}
+
+static void place_thread(int i)
+{
+	/* The vcore scheduler decides where upthreads run. */
+#ifdef USE_PTHREAD
+	pin_to_core(placement_cpu(i));
+#endif
+}
+
+static void *producer_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct tdata *t = &producers[id];
+
+	place_thread(id);
+	tree_barrier_wait(&barrier, id + 1);
+	while (1) {
+		uint64_t now = read_tsc();
+		if (now >= end_tsc)
+			break;
+		switch (type) {
+			case QUEUE_MUTEX:
+				mutex_push(&mq, now, t);
+				break;
+			case QUEUE_SPSC:
+				while (!spsc_push(&spsc[id], now))
+					backoff(t);
+				break;
+			case QUEUE_MPMC:
+				while (!mpmc_push(&mpmc, now))
+					backoff(t);
+				break;
+		}
+		t->items++;
+	}
+
+	if (__sync_sub_and_fetch(&producers_left, 1) == 0 && type == QUEUE_MUTEX) {
+		/* Wake any consumers blocked on an empty queue so they can see
+		 * that we're done. */
+		pthread_mutex_lock(&mq.lock);
+		pthread_cond_broadcast(&mq.not_empty);
+		pthread_mutex_unlock(&mq.lock);
+	}
+	return NULL;
+}
+
+static void *consumer_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct tdata *t = &consumers[id];
+	uint64_t v = 0;
+
+	place_thread(nr_producers + id);
+	tree_barrier_wait(&barrier, nr_producers + id + 1);
+	while (1) {
+		bool got = false;
+		switch (type) {
+			case QUEUE_MUTEX:
+				if (!mutex_pop(&mq, &v, t))
+					return NULL;
+				got = true;
+				break;
+			case QUEUE_SPSC:
+				got = spsc_pop(&spsc[id], &v);
+				break;
+			case QUEUE_MPMC:
+				got = mpmc_pop(&mpmc, &v);
+				break;
+		}
+		if (got) {
+			hist_add(&t->lat, read_tsc() - v);
+			t->items++;
+			continue;
+		}
+		/* Empty: we're done if the producers are, after one last look, since
+		 * they may have pushed something since we checked. */
+		if (!producers_left) {
+			cmb();
+			if (type == QUEUE_SPSC ? spsc_pop(&spsc[id], &v)
+			                       : mpmc_pop(&mpmc, &v)) {
+				hist_add(&t->lat, read_tsc() - v);
+				t->items++;
+				continue;
+			}
+			return NULL;
+		}
+		backoff(t);
+	}
+}
+
+static void parse_args(int argc, char **argv)
+{
+	if (argc > 1)
+		type_name = argv[1];
+	if (argc > 2)
+		nr_producers = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		nr_consumers = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		duration = strtol(argv[4], 0, 10);
+	if (argc > 5)
+		capacity = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		wait_name = argv[6];
+	if (argc > 7)
+		human = strtol(argv[7], 0, 10);
+	if (argc > 8)
+		preempt_period = strtol(argv[8], 0, 10);
+
+	if (!strcmp(type_name, "mutex"))
+		type = QUEUE_MUTEX;
+	else if (!strcmp(type_name, "spsc"))
+		type = QUEUE_SPSC;
+	else if (!strcmp(type_name, "mpmc"))
+		type = QUEUE_MPMC;
+	else {
+		fprintf(stderr, "Unknown queue type: %s\n", type_name);
+		exit(1);
+	}
+	if (!strcmp(wait_name, "spin"))
+		wait_policy = WAIT_SPIN;
+	else if (!strcmp(wait_name, "yield"))
+		wait_policy = WAIT_YIELD;
+	else {
+		fprintf(stderr, "Unknown wait policy: %s\n", wait_name);
+		exit(1);
+	}
+	if (type == QUEUE_SPSC && nr_producers != nr_consumers) {
+		fprintf(stderr, "spsc needs one consumer per producer\n");
+		exit(1);
+	}
+	if (capacity < 2 || (capacity & (capacity - 1))) {
+		fprintf(stderr, "capacity must be a power of two\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	topology_init();
+	results_init("queue", argc, argv);
+
+	pthread_t *thandles = calloc(nr_producers + nr_consumers,
+	                             sizeof(pthread_t));
+	producers = aligned_alloc(ARCH_CL_SIZE,
+	                          sizeof(struct tdata) * nr_producers);
+	consumers = aligned_alloc(ARCH_CL_SIZE,
+	                          sizeof(struct tdata) * nr_consumers);
+	memset(producers, 0, sizeof(struct tdata) * nr_producers);
+	memset(consumers, 0, sizeof(struct tdata) * nr_consumers);
+	switch (type) {
+		case QUEUE_MUTEX:
+			mutex_init(&mq);
+			break;
+		case QUEUE_SPSC:
+			spsc = aligned_alloc(ARCH_CL_SIZE,
+			                     sizeof(struct spsc_queue) * nr_producers);
+			for (int i = 0; i < nr_producers; i++)
+				spsc_init(&spsc[i]);
+			break;
+		case QUEUE_MPMC:
+			mpmc_init(&mpmc);
+			break;
+	}
+	producers_left = nr_producers;
+
+	/* Do any library specific test prep */
+	test_prep();
+	tree_barrier_init(&barrier, nr_producers + nr_consumers + 1,
+	                  TREE_BARRIER_YIELD | TREE_BARRIER_GATED);
+	for (int i = 0; i < nr_producers; i++)
+		pthread_create(&thandles[i], NULL, producer_thread, (void*)(long)i);
+	for (int i = 0; i < nr_consumers; i++)
+		pthread_create(&thandles[nr_producers + i], NULL, consumer_thread,
+		               (void*)(long)i);
+
+	struct cpu_usage usage;
+	tree_barrier_gather(&barrier, 0);
+	cpu_usage_begin(&usage);
+	start_tsc = read_tsc();
+	end_tsc = start_tsc + sec2tsc(duration);
+	tree_barrier_release(&barrier);
+
+	for (int i = 0; i < nr_producers + nr_consumers; i++)
+		pthread_join(thandles[i], NULL);
+	uint64_t drained_tsc = read_tsc();
+	cpu_usage_end(&usage);
+
+	static struct histogram lat;
+	uint64_t produced = 0, consumed = 0, pwaits = 0, cwaits = 0;
+	for (int i = 0; i < nr_producers; i++) {
+		produced += producers[i].items;
+		pwaits += producers[i].waits;
+	}
+	for (int i = 0; i < nr_consumers; i++) {
+		consumed += consumers[i].items;
+		cwaits += consumers[i].waits;
+		hist_merge(&lat, &consumers[i].lat);
+	}
+	if (produced != consumed)
+		fprintf(stderr, "Lost items: produced %ld, consumed %ld\n",
+		        produced, consumed);
+
+	uint64_t items_per_sec = consumed * get_tsc_freq()
+	                         / (drained_tsc - start_tsc);
+	uint64_t p50 = tsc2nsec(hist_percentile(&lat, 50));
+	uint64_t p99 = tsc2nsec(hist_percentile(&lat, 99));
+	uint64_t p999 = tsc2nsec(hist_percentile(&lat, 99.9));
+	uint64_t mean = tsc2nsec(hist_mean(&lat));
+	uint64_t max = tsc2nsec(lat.max);
+	/* Waiting on an empty or full queue is idle time too. */
+	uint64_t spins = tree_barrier_spins(&barrier) + pwaits + cwaits;
+	if (human) {
+		printf("%s queue (%s on empty/full): %d producers, %d consumers, "
+		       "capacity: %d\n", type_name,
+		       type == QUEUE_MUTEX ? "block" : wait_name, nr_producers,
+		       nr_consumers, capacity);
+		printf("  items/s:  %ld (%ld items)\n", items_per_sec, consumed);
+		printf("  latency:  mean %ldns, p50 %ldns, p99 %ldns, p99.9 %ldns, "
+		       "max %ldns\n", mean, p50, p99, p999, max);
+		printf("  waits:    producers %ld, consumers %ld\n", pwaits, cwaits);
+		print_cpu_usage(stdout, &usage, consumed, spins);
+	} else {
+		printf("%s:%d:%d:%d:%s:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld\n",
+		       type_name, nr_producers, nr_consumers, capacity, wait_name,
+		       get_tsc_freq(), start_tsc, drained_tsc, consumed, mean, p50,
+		       p99, p999, max, pwaits + cwaits);
+	}
+
+	struct result r;
+	result_begin(&r, type_name);
+	result_param_int(&r, "nr_producers", nr_producers);
+	result_param_int(&r, "nr_consumers", nr_consumers);
+	result_param_int(&r, "duration", duration);
+	result_param_int(&r, "capacity", capacity);
+	result_param_str(&r, "wait", type == QUEUE_MUTEX ? "block" : wait_name);
+	result_param_int(&r, "preempt_period", preempt_period);
+	result_param_str(&r, "placement", topology.policy);
+	result_metric_int(&r, "tsc_freq", get_tsc_freq());
+	result_metric_int(&r, "beg", start_tsc);
+	result_metric_int(&r, "end", drained_tsc);
+	result_metric_int(&r, "count", consumed);
+	result_metric_int(&r, "mean_ns", mean);
+	result_metric_int(&r, "p50_ns", p50);
+	result_metric_int(&r, "p99_ns", p99);
+	result_metric_int(&r, "p999_ns", p999);
+	result_metric_int(&r, "max_ns", max);
+	result_metric_int(&r, "producer_waits", pwaits);
+	result_metric_int(&r, "consumer_waits", cwaits);
+	result_cpu_usage(&r, &usage, consumed, spins);
+	result_end(&r);
+	return 0;
+}
@@ -21,15 +21,10 @@
 #include <parlib/arch.h>
 #include <parlib/atomic.h>
 #include "../libconfig.h"
-
-void pin_to_core(int core)
-{
-	cpu_set_t c;                                                                           
-	CPU_ZERO(&c);
-	CPU_SET(core, &c);
-	sched_setaffinity(0, sizeof(cpu_set_t), &c);
-	sched_yield();                                                                         
-}
+#include "../barrier.h"
+#include "../topology.h"
+#include "../results.h"
+#include "../cpuusage.h"
 
 void multi_core_tests(int nthreads, int duration, bool human)
 {
@@ -41,15 +36,20 @@ void multi_core_tests(int nthreads, int duration, bool human)
 		bool stop;
 		bool done;
 		uint64_t count;
+		int cpu;
 	} __attribute__((aligned(ARCH_CL_SIZE)));
 
-	static int barrier;
-	static void (*run_loop)(int, int, int);
+	static struct tree_barrier barrier;
 	static char *run_prefix;
 	static pthread_t thread;
-	static struct tdata *tdata;
+	static struct tdata **tdata;
 	static bool test_done;
-	tdata = aligned_alloc(PGSIZE, sizeof(struct tdata) * nthreads);
+	static struct cpu_usage usage;
+	/* Each thread's data lives on the node it runs on. */
+	tdata = malloc(sizeof(struct tdata*) * nthreads);
+	for (int i = 0; i < nthreads; i++)
+		tdata[i] = node_alloc(sizeof(struct tdata),
+		                      cpu_node(placement_cpu(i)));
 
 	void dump_results(char *prefix, bool human)
 	{
@@ -58,43 +58,79 @@ void multi_core_tests(int nthreads, int duration, bool human)
 			uint64_t max_end_time = 0;
 			uint64_t min_beg_time = LONG_MAX;
 			printf("Multicore %s test:\n", prefix);
+			print_topology(stdout, nthreads);
 			for (int i=0; i<nthreads; i++) {
-				printf("  Thread %2d: ", i);
+				printf("  Thread %2d (cpu %2d, node %d): ", i, tdata[i]->cpu,
+				       cpu_node(tdata[i]->cpu));
 				printf("    ops/s: %ld",
-				         tdata[i].count/tsc2msec(tdata[i].end_time 
-						                         - tdata[i].beg_time) * 1000);
+				         tdata[i]->count/tsc2msec(tdata[i]->end_time 
+						                         - tdata[i]->beg_time) * 1000);
 				printf("    latency: %ldns\n",
-				         tsc2nsec(tdata[i].end_time - tdata[i].beg_time)
-						 / tdata[i].count);
-				tcount += tdata[i].count;
-				max_end_time = MAX(max_end_time, tdata[i].end_time);
-				min_beg_time = MIN(min_beg_time, tdata[i].beg_time);
+				         tsc2nsec(tdata[i]->end_time - tdata[i]->beg_time)
+						 / tdata[i]->count);
+				tcount += tdata[i]->count;
+				max_end_time = MAX(max_end_time, tdata[i]->end_time);
+				min_beg_time = MIN(min_beg_time, tdata[i]->beg_time);
 			}
 			printf("  Total  : ");
 			printf("    ops/s: %ld",
 			         tcount/tsc2msec(max_end_time - min_beg_time) * 1000);
 			printf("   latency: %ldns\n",
 			         tsc2nsec(max_end_time - min_beg_time)/tcount);
+			print_cpu_usage(stdout, &usage, tcount,
+			                tree_barrier_spins(&barrier));
 		} else {
 			for (int i=0; i<nthreads; i++)
-				printf("%d:%ld:%ld:%ld:%ld\n", i, tdata[i].tsc_freq,
-				       tdata[i].beg_time, tdata[i].end_time, tdata[i].count);
+				printf("%d:%ld:%ld:%ld:%ld:%d:%d\n", i, tdata[i]->tsc_freq,
+				       tdata[i]->beg_time, tdata[i]->end_time, tdata[i]->count,
+				       tdata[i]->cpu, cpu_node(tdata[i]->cpu));
+		}
+		for (int i=0; i<nthreads && results_enabled(); i++) {
+			struct result r;
+			result_begin(&r, prefix);
+			result_param_int(&r, "nthreads", nthreads);
+			result_param_int(&r, "duration", duration);
+			result_param_str(&r, "placement", topology.policy);
+			result_param_int(&r, "thread", i);
+			result_param_int(&r, "cpu", tdata[i]->cpu);
+			result_param_int(&r, "node", cpu_node(tdata[i]->cpu));
+			result_metric_int(&r, "tsc_freq", tdata[i]->tsc_freq);
+			result_metric_int(&r, "beg", tdata[i]->beg_time);
+			result_metric_int(&r, "end", tdata[i]->end_time);
+			result_metric_int(&r, "count", tdata[i]->count);
+			result_end(&r);
+		}
+		/* Cpu time is only known for the whole process. */
+		if (results_enabled()) {
+			uint64_t tcount = 0;
+			for (int i=0; i<nthreads; i++)
+				tcount += tdata[i]->count;
+			struct result r;
+			result_begin(&r, "cpu");
+			result_param_int(&r, "nthreads", nthreads);
+			result_param_int(&r, "duration", duration);
+			result_param_str(&r, "placement", topology.policy);
+			result_metric_int(&r, "tsc_freq", get_tsc_freq());
+			result_metric_int(&r, "count", tcount);
+			result_cpu_usage(&r, &usage, tcount,
+			                 tree_barrier_spins(&barrier));
+			result_end(&r);
 		}
 	}
 
 	void alarm_handler(int sig)
 	{
-		tdata[0].stop = true;
+		tdata[0]->stop = true;
 	}
 
 	void yieldloop(int id, int fdr, int fdw) {
 		/* Pull these out to optimize the loop. */
-		volatile bool *stop = &tdata[id].stop;
-		uint64_t *count = &tdata[id].count;
+		volatile bool *stop = &tdata[id]->stop;
+		uint64_t *count = &tdata[id]->count;
 		char buf[1000];
 
 		/* Do the loop */
-		tdata[id].beg_time = read_tsc();
+		tdata[id]->beg_time = read_tsc();
 		while (!*stop) {
 			if (read(fdr, buf, 1000) == -1)
 				perror("read");
@@ -104,8 +140,8 @@ void multi_core_tests(int nthreads, int duration, bool human)
 				perror("write");
 			(*count)++;
 		}
-		tdata[id].end_time = read_tsc();
-		tdata[id].done = true;
+		tdata[id]->end_time = read_tsc();
+		tdata[id]->done = true;
 	}
 
 	void *thread_handler(void *arg)
@@ -117,40 +153,41 @@ void multi_core_tests(int nthreads, int duration, bool human)
 		/* When id == 0, we are coming in from the main thread, so skip all
 		 * this work that we will have already done. */
 		if (id != 0) {
-			pin_to_core(id);
+			pin_to_core(placement_cpu(id));
 			/* Get this core's tsc_frequency. */
-			tdata[id].tsc_freq = get_tsc_freq();
-			/* Up the barrier. */
-			__sync_fetch_and_add(&barrier, 1);
+			tdata[id]->tsc_freq = get_tsc_freq();
+			tdata[id]->cpu = sched_getcpu();
 			/* Checkin and barrier waiting for all cpus to come up. */
-			while (barrier < nthreads)
-				pthread_yield();
+			tree_barrier_wait(&barrier, id);
 		} else {
 			/* Set the alarm */
+			cpu_usage_begin(&usage);
 			alarm(duration);
 			/* Release the threads */
-			barrier++;
+			tree_barrier_release(&barrier);
 		}
 
-		/* Run the loop. */
-		run_loop(id, fdr, fdw);
+		/* Run the loop.  Called directly, not through a pointer, so it can
+		 * be inlined here. */
+		yieldloop(id, fdr, fdw);
 	}
 
-	void run_test(char *prefix, int duration, void (*test_func)(int, int, int))
+	void run_test(char *prefix, int duration)
 	{
 		/* Set up the globals for the test */
 		run_prefix = prefix;
-		run_loop = test_func;
-		barrier = 0;
+		tree_barrier_init(&barrier, nthreads,
+		                  TREE_BARRIER_YIELD | TREE_BARRIER_GATED);
 		test_done = false;
 		for (int i=0; i<nthreads; i++) {
-			tdata[i].tsc_freq = 0;
-			tdata[i].beg_time = 0;
-			tdata[i].end_time = 0;
-			tdata[i].start = ATOMIC_INITIALIZER(0);
-			tdata[i].stop = 0;
-			tdata[i].done = 0;
-			tdata[i].count = 0;
+			tdata[i]->tsc_freq = 0;
+			tdata[i]->beg_time = 0;
+			tdata[i]->end_time = 0;
+			tdata[i]->start = ATOMIC_INITIALIZER(0);
+			tdata[i]->stop = 0;
+			tdata[i]->done = 0;
+			tdata[i]->count = 0;
+			tdata[i]->cpu = -1;
 		}
 
 #ifndef USE_PTHREAD
@@ -160,17 +197,17 @@ void multi_core_tests(int nthreads, int duration, bool human)
 #endif
 
 		/* Set myself up similar to other threads. */
-		pin_to_core(0);
-		atomic_set(&tdata[0].start, 1);
-		tdata[0].tsc_freq = get_tsc_freq();
+		pin_to_core(placement_cpu(0));
+		atomic_set(&tdata[0]->start, 1);
+		tdata[0]->tsc_freq = get_tsc_freq();
+		tdata[0]->cpu = sched_getcpu();
 
 		/* Spawn off 1 thread per core except for core 0. */
 		for (int i = 1; i < nthreads; i++)
 			pthread_create(&thread, NULL, thread_handler, (void*)(long)i);
 		
 		/* Barrier waiting for all other threads to come up. */
-		while (barrier < (nthreads - 1))
-			pthread_yield();
+		tree_barrier_gather(&barrier, 0);
 
 		/* Become thread 0 */
 		thread_handler(0);
@@ -178,11 +215,13 @@ void multi_core_tests(int nthreads, int duration, bool human)
 		/* When we get here, the alarm went off and we need to conclude the
 		 * test. Stop the other threads. */
 		for (int i=1; i<nthreads; i++)
-			tdata[i].stop = true;
+			tdata[i]->stop = true;
 		for (int i=1; i<nthreads; i++)
-			while (!tdata[i].done)
+			while (!tdata[i]->done)
 				cpu_relax();
+		cpu_usage_end(&usage);
 		dump_results(run_prefix, human);
+		tree_barrier_destroy(&barrier);
 	}
 
 	/* Set up the alarm */
@@ -193,7 +232,7 @@ void multi_core_tests(int nthreads, int duration, bool human)
 	sigaction(SIGALRM, &act, NULL);
 
 	/* Run the tests */
-	run_test("CTXSWITCH", duration, yieldloop);
+	run_test("CTXSWITCH", duration);
 }
 
 void print_header(char *name, int nthreads, int duration, bool human)
@@ -218,6 +257,11 @@ int main (int argc, char **argv)
 	if (argc > 3)
 		human = strtol(argv[3], 0, 10);
 
+	topology_init();
+	results_init("readwrite", argc, argv);
+	result_topology();
+	if (!human)
+		print_topology(stderr, nthreads);
 	print_header("ctxswitch", nthreads, duration, human);
 	multi_core_tests(nthreads, duration, human);
 }
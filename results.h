@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* Structured results shared by all the benchmarks.  When RESULTS_FILE is set
+ * in the environment, every result is also appended to it as one JSON object
+ * per line (JSON Lines), alongside the usual human or colon separated output:
+ *
+ *   {"schema": 1, "run_id": "...", "time": 1413000000,
+ *    "benchmark": "ctxswitch", "library": "upthread-pvcq", "test": "CTXSWITCH",
+ *    "machine": {"host": ..., "kernel": ..., "cpu": ..., "nr_cpus": ...,
+ *                "tsc_freq": ...},
+ *    "cmdline": "...", "params": {...}, "metrics": {...}}
+ *
+ * All records from one process share a run_id.  Records written while the
+ * run is marked noisy (see ../jitter.h) also get "noisy": true.  Usage:
+ *
+ *   results_init("ctxswitch", argc, argv);
+ *   ...
+ *   struct result r;
+ *   result_begin(&r, "CTXSWITCH");
+ *   result_param_int(&r, "ncpus", ncpus);
+ *   result_metric_int(&r, "count", count);
+ *   result_end(&r);
+ *
+ * See tools/results.py for loading them back. */
+
+#ifndef BENCHMARKS_RESULTS_H
+#define BENCHMARKS_RESULTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <parlib/timing.h>
+
+#define RESULTS_SCHEMA 1
+
+#ifndef LIB_NAME
+#define LIB_NAME "native"
+#endif
+
+static struct {
+	FILE *f;
+	const char *benchmark;
+	char run_id[128];
+	char machine[1024];
+	char cmdline[1024];
+	bool noisy;
+} results;
+
+struct result {
+	const char *test;
+	char params[1024];
+	char metrics[4096];
+	int nr_params;
+	int nr_metrics;
+};
+
+/* Copy src into dst as the inside of a JSON string. */
+static void __results_escape(char *dst, size_t len, const char *src)
+{
+	size_t n = 0;
+	for (; *src && n + 2 < len; src++) {
+		if (*src == '"' || *src == '\\')
+			dst[n++] = '\\';
+		dst[n++] = (*src == '\n' || *src == '\t') ? ' ' : *src;
+	}
+	dst[n] = '\0';
+}
+
+static void __results_cpu_model(char *buf, size_t len)
+{
+	char line[256];
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	buf[0] = '\0';
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "model name", 10)) {
+			char *p = strchr(line, ':');
+			if (p)
+				__results_escape(buf, len, p + 2 + strspn(p + 2, " "));
+			break;
+		}
+	}
+	fclose(f);
+	size_t n = strcspn(buf, "\n");
+	while (n > 0 && buf[n - 1] == ' ')
+		n--;
+	buf[n] = '\0';
+}
+
+static void results_init(const char *benchmark, int argc, char **argv)
+{
+	char *path = getenv("RESULTS_FILE");
+	char host[64], cpu[128], kernel[256], arg[256];
+	struct utsname u;
+
+	results.benchmark = benchmark;
+	if (!path || !*path)
+		return;
+	results.f = fopen(path, "a");
+	if (!results.f) {
+		perror(path);
+		return;
+	}
+
+	gethostname(host, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+	uname(&u);
+	snprintf(arg, sizeof(arg), "%s %s", u.release, u.version);
+	__results_escape(kernel, sizeof(kernel), arg);
+	__results_cpu_model(cpu, sizeof(cpu));
+	snprintf(results.run_id, sizeof(results.run_id), "%s-%ld-%d", host,
+	         (long)time(NULL), getpid());
+	snprintf(results.machine, sizeof(results.machine),
+	         "{\"host\": \"%s\", \"kernel\": \"%s\", \"arch\": \"%s\", "
+	         "\"cpu\": \"%s\", \"nr_cpus\": %ld, \"tsc_freq\": %lu}",
+	         host, kernel, u.machine, cpu, sysconf(_SC_NPROCESSORS_ONLN),
+	         get_tsc_freq());
+
+	results.cmdline[0] = '\0';
+	for (int i = 0; i < argc; i++) {
+		size_t n = strlen(results.cmdline);
+		__results_escape(arg, sizeof(arg), argv[i]);
+		snprintf(results.cmdline + n, sizeof(results.cmdline) - n, "%s%s",
+		         i ? " " : "", arg);
+	}
+}
+
+static inline bool results_enabled(void)
+{
+	return results.f != NULL;
+}
+
+/* Flag the records that follow as measured under too much OS noise. */
+static inline void results_set_noisy(bool noisy)
+{
+	results.noisy = noisy;
+}
+
+static inline void result_begin(struct result *r, const char *test)
+{
+	r->test = test;
+	r->params[0] = r->metrics[0] = '\0';
+	r->nr_params = r->nr_metrics = 0;
+}
+
+static void __result_add(char *buf, size_t len, int *nr, const char *key,
+                         const char *fmt, ...)
+{
+	va_list ap;
+	size_t n;
+	if (!results.f)
+		return;
+	n = strlen(buf);
+	n += snprintf(buf + n, len - n, "%s\"%s\": ", (*nr)++ ? ", " : "", key);
+	if (n >= len)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(buf + n, len - n, fmt, ap);
+	va_end(ap);
+}
+
+#define __result_add_to(r, which, key, fmt, ...) \
+	__result_add((r)->which, sizeof((r)->which), &(r)->nr_##which, key, \
+	             fmt, __VA_ARGS__)
+
+static inline void result_param_int(struct result *r, const char *key,
+                                    long val)
+{
+	__result_add_to(r, params, key, "%ld", val);
+}
+
+static inline void result_param_str(struct result *r, const char *key,
+                                    const char *val)
+{
+	char esc[256];
+	__results_escape(esc, sizeof(esc), val);
+	__result_add_to(r, params, key, "\"%s\"", esc);
+}
+
+static inline void result_metric_int(struct result *r, const char *key,
+                                     uint64_t val)
+{
+	__result_add_to(r, metrics, key, "%lu", val);
+}
+
+/* JSON has no inf or nan, so those (like a rate over a zero-length window)
+ * go out as null. */
+static inline void result_metric_double(struct result *r,
+                                        const char *key, double val)
+{
+	if (!isfinite(val))
+		__result_add_to(r, metrics, key, "%s", "null");
+	else
+		__result_add_to(r, metrics, key, "%.9g", val);
+}
+
+static void result_end(struct result *r)
+{
+	if (!results.f)
+		return;
+	fprintf(results.f,
+	        "{\"schema\": %d, \"run_id\": \"%s\", \"time\": %ld, "
+	        "\"benchmark\": \"%s\", \"library\": \"%s\", \"test\": \"%s\", "
+	        "\"machine\": %s, \"cmdline\": \"%s\", "
+	        "\"params\": {%s}, \"metrics\": {%s}%s}\n",
+	        RESULTS_SCHEMA, results.run_id, (long)time(NULL),
+	        results.benchmark, LIB_NAME, r->test, results.machine,
+	        results.cmdline, r->params, r->metrics,
+	        results.noisy ? ", \"noisy\": true" : "");
+	fflush(results.f);
+}
+
+#endif /* BENCHMARKS_RESULTS_H */
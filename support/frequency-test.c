@@ -1,53 +1,444 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Timer and signal delivery costs, for picking a preemption mechanism and
+ * period.  'nr_threads' threads, one per cpu, spin in a loop watching the tsc
+ * while a timer or signal interrupts them every 'period_us' microseconds:
+ *
+ *   hz        - the old estimate of the kernel's timer interrupt rate, from
+ *               how fast a 250us setitimer actually fires
+ *   setitimer - one process wide ITIMER_REAL, delivered to whichever thread
+ *               the kernel picks
+ *   posix     - a timer_create() timer per thread, delivered to that thread
+ *               with SIGEV_THREAD_ID
+ *   timerfd   - a timerfd per thread, which the thread blocks reading instead
+ *               of spinning
+ *   tgkill    - the main thread sends each thread a signal with tgkill()
+ *   all       - all of the above, one after the other (the default)
+ *
+ * For each we report:
+ *
+ *   latency  - how late the handler (or the read) ran relative to when the
+ *              timer was due or the signal was sent.  For the timers this is
+ *              measured from the last period boundary, so it's only right
+ *              while it stays under a period.  Jitter is p99 - p50.
+ *   overhead - how much time each delivery stole from the spinning thread:
+ *              kernel entry, signal frame, handler and sigreturn.  Not
+ *              available for timerfd, since the thread is asleep.
+ *   missed   - deliveries we expected but never saw, because the kernel
+ *              coalesced them or couldn't keep up
+ *
+ * usage: frequency-test [mechanism] [nr_threads] [period_us] [duration]
+ *                       [human] */
+
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
-
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../topology.h"
+#include "../histogram.h"
+#include "../results.h"
 
 #define USECREQ 250
 #define LOOPS   1000
 
-void event_handler (int signum)
-{
-	static unsigned long cnt = 0;
-	static struct timeval tsFirst;
-	if (cnt == 0) {
-		gettimeofday (&tsFirst, 0);
-	} 
-	cnt ++;
-	if (cnt >= LOOPS) {
-		struct timeval tsNow;
-		struct timeval diff;
-		setitimer (ITIMER_REAL, NULL, NULL);
-		gettimeofday (&tsNow, 0);
-		timersub(&tsNow, &tsFirst, &diff);
-		unsigned long long udiff = (diff.tv_sec * 1000000) + diff.tv_usec;
-		double delta = (double)(udiff/cnt)/1000000;
-		int hz = (unsigned)(1.0/delta);
-		printf ("kernel timer interrupt frequency is approx. %d Hz", hz);
-		if (hz >= (int) (1.0/((double)(USECREQ)/1000000))) {
-			printf (" or higher");
-		}       
-		printf ("\n");
-		exit (0);
-	}
-}
-
-int main (int argc, char **argv)
+enum { MECH_SETITIMER, MECH_POSIX, MECH_TIMERFD, MECH_TGKILL, NR_MECHS };
+static const char *mech_names[] = {"setitimer", "posix", "timerfd", "tgkill"};
+
+/* Modifiable via command line */
+char *mechanism = "all";
+int nr_threads = 1;
+int period_us = 1000;
+int duration = 2;
+int human = 1;
+
+struct tstate {
+	pid_t tid;
+	volatile uint64_t deliveries;
+	volatile uint64_t sent_tsc;     /* tgkill only */
+	uint64_t sent;
+	uint64_t missed;
+	struct histogram latency;
+	struct histogram overhead;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct tstate *tstates;
+static __thread struct tstate *me;
+static int mech;
+static uint64_t period_tsc;
+static uint64_t start_tsc;
+static struct timespec start_mono;
+static pthread_barrier_t barrier;
+static volatile bool stop;
+
+/* Lateness relative to the last period boundary since the timers started. */
+static inline uint64_t timer_latency(uint64_t now)
+{
+	return (now - start_tsc) % period_tsc;
+}
+
+/* The signal each mechanism delivers, if any. */
+static int mech_signal(int m)
+{
+	switch (m) {
+		case MECH_SETITIMER:
+			return SIGALRM;
+		case MECH_POSIX:
+			return SIGRTMIN;
+		case MECH_TGKILL:
+			return SIGUSR1;
+	}
+	return 0;
+}
+
+static void handler(int sig)
+{
+	uint64_t now = read_tsc();
+	struct tstate *t = me;
+	if (!t)
+		return;
+	if (mech == MECH_TGKILL)
+		hist_add(&t->latency, now - t->sent_tsc);
+	else
+		hist_add(&t->latency, timer_latency(now));
+	t->deliveries++;
+}
+
+static void timespec_add_usec(struct timespec *ts, uint64_t usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Spin until told to stop, charging the loop's time to each delivery.  When
+ * we first see a new delivery, its handler ran somewhere in the last two
+ * iterations, so we charge both: one iteration too many, but it always covers
+ * the whole thing. */
+static void spin(struct tstate *t)
+{
+	uint64_t seen = t->deliveries;
+	uint64_t prev = read_tsc(), last = prev;
+	while (!stop) {
+		uint64_t deliveries = t->deliveries;
+		uint64_t now = read_tsc();
+		if (deliveries != seen) {
+			seen = deliveries;
+			hist_add(&t->overhead, now - prev);
+		}
+		prev = last;
+		last = now;
+	}
+}
+
+static void wait_timerfd(struct tstate *t, int fd)
+{
+	uint64_t expirations;
+	while (!stop) {
+		if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+		hist_add(&t->latency, timer_latency(read_tsc()));
+		t->deliveries++;
+		t->missed += expirations - 1;
+	}
+}
+
+static void *delivery_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct tstate *t = &tstates[id];
+	timer_t timer;
+	int fd = -1;
+
+	pin_to_core(placement_cpu(id));
+	t->tid = syscall(SYS_gettid);
+	me = t;
+
+	/* main blocked our signals before creating us, so that setitimer's only
+	 * land on threads that are measuring them. */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGRTMIN);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+	pthread_barrier_wait(&barrier);
+	/* main sets the start time and arms setitimer in between these. */
+	pthread_barrier_wait(&barrier);
+
+	/* Arm anything per thread relative to the start. */
+	struct itimerspec its = {0};
+	its.it_value = start_mono;
+	timespec_add_usec(&its.it_value, period_us);
+	its.it_interval.tv_nsec = (uint64_t)period_us * 1000 % 1000000000;
+	its.it_interval.tv_sec = period_us / 1000000;
+	if (mech == MECH_POSIX) {
+		struct sigevent sev = {0};
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGRTMIN;
+		sev._sigev_un._tid = t->tid;
+		timer_create(CLOCK_MONOTONIC, &sev, &timer);
+		timer_settime(timer, TIMER_ABSTIME, &its, NULL);
+	} else if (mech == MECH_TIMERFD) {
+		fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+	if (mech == MECH_TIMERFD)
+		wait_timerfd(t, fd);
+	else
+		spin(t);
+
+	if (mech == MECH_POSIX)
+		timer_delete(timer);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/* Send every thread a signal each period, until the run is over. */
+static void send_tgkills(uint64_t end_tsc)
+{
+	pid_t pid = getpid();
+	uint64_t next = start_tsc + period_tsc;
+	/* Stay off the threads' cpus if there are any left. */
+	if (nr_threads < topology.nr_cpus)
+		pin_to_core(placement_cpu(nr_threads));
+	while (next < end_tsc) {
+		while (read_tsc() < next)
+			sched_yield();
+		for (int i = 0; i < nr_threads; i++) {
+			tstates[i].sent_tsc = read_tsc();
+			syscall(SYS_tgkill, pid, tstates[i].tid, SIGUSR1);
+			tstates[i].sent++;
+			/* Don't send the next one until this one's landed. */
+			while (tstates[i].deliveries != tstates[i].sent
+			       && read_tsc() < next + period_tsc)
+				sched_yield();
+		}
+		next += period_tsc;
+	}
+}
+
+static void run_mechanism(int m)
+{
+	pthread_t *thandles = calloc(nr_threads, sizeof(pthread_t));
+	mech = m;
+	stop = false;
+	period_tsc = usec2tsc(period_us);
+	memset(tstates, 0, sizeof(struct tstate) * nr_threads);
+
+	if (mech_signal(m)) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = &handler;
+		sa.sa_flags = SA_RESTART;
+		sigaction(mech_signal(m), &sa, NULL);
+	}
+
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&thandles[i], NULL, delivery_thread, (void*)(long)i);
+
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start_mono);
+	start_tsc = read_tsc();
+	uint64_t end_tsc = start_tsc + sec2tsc(duration);
+	if (m == MECH_SETITIMER) {
+		struct itimerval timer;
+		timer.it_value.tv_sec = period_us / 1000000;
+		timer.it_value.tv_usec = period_us % 1000000;
+		timer.it_interval = timer.it_value;
+		setitimer(ITIMER_REAL, &timer, NULL);
+	}
+	pthread_barrier_wait(&barrier);
+
+	if (m == MECH_TGKILL) {
+		send_tgkills(end_tsc);
+	} else {
+		struct timespec ts = {duration, 0};
+		while (nanosleep(&ts, &ts))
+			;
+	}
+	if (m == MECH_SETITIMER)
+		setitimer(ITIMER_REAL, NULL, NULL);
+	uint64_t elapsed = read_tsc() - start_tsc;
+	stop = true;
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(thandles[i], NULL);
+	pthread_barrier_destroy(&barrier);
+	free(thandles);
+
+	static struct histogram latency, overhead;
+	memset(&latency, 0, sizeof(latency));
+	memset(&overhead, 0, sizeof(overhead));
+	uint64_t deliveries = 0, missed = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		hist_merge(&latency, &tstates[i].latency);
+		hist_merge(&overhead, &tstates[i].overhead);
+		deliveries += tstates[i].deliveries;
+		missed += tstates[i].missed;
+	}
+	/* Everything but timerfd only knows what it got, not what it missed. */
+	uint64_t expected = elapsed / period_tsc;
+	if (m == MECH_POSIX)
+		expected *= nr_threads;
+	if (m == MECH_TGKILL) {
+		expected = 0;
+		for (int i = 0; i < nr_threads; i++)
+			expected += tstates[i].sent;
+	}
+	if (m != MECH_TIMERFD)
+		missed = expected > deliveries ? expected - deliveries : 0;
+
+	uint64_t lat_p50 = tsc2nsec(hist_percentile(&latency, 50));
+	uint64_t lat_p99 = tsc2nsec(hist_percentile(&latency, 99));
+	uint64_t lat_max = tsc2nsec(latency.max);
+	uint64_t ovh_p50 = tsc2nsec(hist_percentile(&overhead, 50));
+	uint64_t ovh_p99 = tsc2nsec(hist_percentile(&overhead, 99));
+	/* Share of the spinning threads' time that went to deliveries. */
+	double ovh_pct = 100.0 * overhead.sum / ((double)elapsed * nr_threads);
+
+	if (human) {
+		printf("%s: %d threads, period %dus, %ld deliveries, %ld missed\n",
+		       mech_names[m], nr_threads, period_us, deliveries, missed);
+		printf("  latency:  p50 %ldns, p99 %ldns, max %ldns, jitter %ldns\n",
+		       lat_p50, lat_p99, lat_max, lat_p99 - lat_p50);
+		if (m != MECH_TIMERFD)
+			printf("  overhead: p50 %ldns, p99 %ldns, %.3f%% of cpu time\n",
+			       ovh_p50, ovh_p99, ovh_pct);
+	} else {
+		printf("%s:%d:%d:%d:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%.4f\n",
+		       mech_names[m], nr_threads, period_us, duration, deliveries,
+		       missed, lat_p50, lat_p99, lat_max, lat_p99 - lat_p50, ovh_p50,
+		       ovh_p99, ovh_pct);
+	}
+
+	struct result r;
+	result_begin(&r, mech_names[m]);
+	result_param_int(&r, "nr_threads", nr_threads);
+	result_param_int(&r, "period_us", period_us);
+	result_param_int(&r, "duration", duration);
+	result_param_str(&r, "placement", topology.policy);
+	result_metric_int(&r, "deliveries", deliveries);
+	result_metric_int(&r, "missed", missed);
+	result_metric_int(&r, "latency_p50_ns", lat_p50);
+	result_metric_int(&r, "latency_p99_ns", lat_p99);
+	result_metric_int(&r, "latency_max_ns", lat_max);
+	result_metric_int(&r, "jitter_ns", lat_p99 - lat_p50);
+	if (m != MECH_TIMERFD) {
+		result_metric_int(&r, "overhead_p50_ns", ovh_p50);
+		result_metric_int(&r, "overhead_p99_ns", ovh_p99);
+		result_metric_double(&r, "overhead_pct", ovh_pct);
+	}
+	result_end(&r);
+}
+
+static volatile unsigned long hz_cnt;
+static struct timeval hz_first;
+
+static void hz_handler(int signum)
+{
+	if (hz_cnt == 0)
+		gettimeofday(&hz_first, 0);
+	if (++hz_cnt >= LOOPS)
+		setitimer(ITIMER_REAL, NULL, NULL);
+}
+
+/* How fast a USECREQ setitimer really fires, which tops out at the kernel's
+ * timer interrupt rate. */
+static void estimate_hz(void)
 {
 	struct sigaction sa;
 	struct itimerval timer;
+	struct timeval now, diff;
 
 	printf("No. of clock ticks per sec from sysconf: %ld\n", sysconf(_SC_CLK_TCK));
-	memset (&sa, 0, sizeof (sa));
-	sa.sa_handler = &event_handler;
-	sigaction (SIGALRM, &sa, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &hz_handler;
+	sigaction(SIGALRM, &sa, NULL);
 	timer.it_value.tv_sec = 0;
 	timer.it_value.tv_usec = USECREQ;
 	timer.it_interval.tv_sec = 0;
 	timer.it_interval.tv_usec = USECREQ;
-	setitimer (ITIMER_REAL, &timer, NULL);
-	while (1);
+	setitimer(ITIMER_REAL, &timer, NULL);
+	while (hz_cnt < LOOPS)
+		cpu_relax();
+
+	gettimeofday(&now, 0);
+	timersub(&now, &hz_first, &diff);
+	unsigned long long udiff = (diff.tv_sec * 1000000) + diff.tv_usec;
+	double delta = (double)(udiff/hz_cnt)/1000000;
+	int hz = (unsigned)(1.0/delta);
+	printf("kernel timer interrupt frequency is approx. %d Hz", hz);
+	if (hz >= (int) (1.0/((double)(USECREQ)/1000000)))
+		printf(" or higher");
+	printf("\n");
+
+	struct result r;
+	result_begin(&r, "timer_hz");
+	result_param_int(&r, "usecreq", USECREQ);
+	result_param_int(&r, "loops", LOOPS);
+	result_metric_int(&r, "clk_tck", sysconf(_SC_CLK_TCK));
+	result_metric_int(&r, "hz", hz);
+	result_end(&r);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		mechanism = argv[1];
+	if (argc > 2)
+		nr_threads = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		period_us = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		duration = strtol(argv[4], 0, 10);
+	if (argc > 5)
+		human = strtol(argv[5], 0, 10);
+
+	topology_init();
+	results_init("frequency-test", argc, argv);
+	tstates = aligned_alloc(ARCH_CL_SIZE, sizeof(struct tstate) * nr_threads);
+
+	bool all = !strcmp(mechanism, "all");
+	if (all || !strcmp(mechanism, "hz"))
+		estimate_hz();
+
+	/* Only the measuring threads take the signals. */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGRTMIN);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	bool found = all || !strcmp(mechanism, "hz");
+	for (int m = 0; m < NR_MECHS; m++) {
+		if (all || !strcmp(mechanism, mech_names[m])) {
+			run_mechanism(m);
+			found = true;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown mechanism: %s\n", mechanism);
+		return 1;
+	}
+	return 0;
 }
@@ -10,46 +10,37 @@
 #include <sys/prctl.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/param.h> /* MIN/MAX */
 #include <sched.h>
 #include <limits.h>
 #include <sys/sysinfo.h>
 #include <pthread.h>
+#include <ucontext.h>
+#include <cpuid.h>
 #include <parlib/timing.h>
 #include <parlib/arch.h>
 #include <parlib/atomic.h>
+#include "../barrier.h"
+#include "../tls-switch.h"
+#include "../topology.h"
+#include "../results.h"
 
 static __thread void *fakefs = 0;
 static void (*wrfsbase)(void *tls_addr);
 static void *(*rdfsbase)(void);
+static const char *mechanism;
+static const char *dispatch;
 
-static inline void *inst_rdfsbase(void)
+/* Finish off a structured result with the timing every test here reports. */
+static void record_timed(struct result *r, uint64_t tsc_freq, uint64_t beg,
+                         uint64_t end, uint64_t count)
 {
-	void *fs;
-	asm volatile(".byte 0xf3,0x48,0x0f,0xae,0xc0 # rdfsbaseq %%rax"
-	             : "=a" (fs)
-	             :: "memory");
-	return fs;
-}
-
-static inline void inst_wrfsbase(void *fs)
-{
-	asm volatile(".byte 0xf3,0x48,0x0f,0xae,0xd0 # wrfsbaseq %%rax"
-	             :: "a" (fs)
-	             : "memory");
-}
-
-static inline void *sys_rdfsbase(void)
-{
-	int arch_prctl(int code, unsigned long *addr);
-	unsigned long fs;
-	arch_prctl(ARCH_GET_FS, &fs);
-	return (void*)fs;
-}
-
-static inline void sys_wrfsbase(void *fs)
-{
-	int arch_prctl(int code, unsigned long *addr);
-	arch_prctl(ARCH_SET_FS, (unsigned long*)fs);
+	result_metric_int(r, "tsc_freq", tsc_freq);
+	result_metric_int(r, "beg", beg);
+	result_metric_int(r, "end", end);
+	result_metric_int(r, "count", count);
+	result_end(r);
 }
 
 static inline void *null_rdfsbase(void)
@@ -62,15 +53,42 @@ static inline void null_wrfsbase(void *fs)
 	fakefs = fs;
 }
 
-void pin_to_core(int core)
-{
-	cpu_set_t c;                                                                           
-	CPU_ZERO(&c);
-	CPU_SET(core, &c);
-	sched_setaffinity(0, sizeof(cpu_set_t), &c);
-	sched_yield();                                                                         
+/* The measured loops, one copy per mechanism so the fs base access is
+ * inlined into it; a call costs about as much as the baseline op does.  The
+ * indirect copy goes through the rdfsbase/wrfsbase pointers instead, which
+ * is what we always used to measure, and is reported as its own test. */
+struct fsbase_loops {
+	uint64_t (*rdloop)(volatile bool *stop, void **tls_addr);
+	uint64_t (*wrloop)(volatile bool *stop, void *tls_addr);
+};
+static struct fsbase_loops loops;
+
+#define DEFINE_FSBASE_LOOPS(name, rd, wr) \
+static uint64_t name##_rdloop(volatile bool *stop, void **tls_addr) \
+{ \
+	uint64_t count = 0; \
+	while (!*stop) { \
+		*tls_addr = rd(); \
+		count++; \
+	} \
+	return count; \
+} \
+static uint64_t name##_wrloop(volatile bool *stop, void *tls_addr) \
+{ \
+	uint64_t count = 0; \
+	while (!*stop) { \
+		wr(tls_addr); \
+		count++; \
+	} \
+	return count; \
 }
 
+DEFINE_FSBASE_LOOPS(null, null_rdfsbase, null_wrfsbase)
+DEFINE_FSBASE_LOOPS(inst, inst_rdfsbase, inst_wrfsbase)
+DEFINE_FSBASE_LOOPS(sys, sys_rdfsbase, sys_wrfsbase)
+DEFINE_FSBASE_LOOPS(indirect, rdfsbase, wrfsbase)
+#define FSBASE_LOOPS(name) {name##_rdloop, name##_wrloop}
+
 void single_core_tests(int time, bool human, bool rdwr[2])
 {
 	void *tls_addr;
@@ -101,9 +119,16 @@ void single_core_tests(int time, bool human, bool rdwr[2])
 		} else {
 			printf("SC:%s:%ld:%ld:%ld:%ld\n", prefix, tsc_freq, beg, end, count);
 		}
+		struct result r;
+		result_begin(&r, "SC");
+		result_param_str(&r, "mechanism", mechanism);
+		result_param_str(&r, "dispatch", dispatch);
+		result_param_str(&r, "op", prefix);
+		result_param_int(&r, "time", time);
+		record_timed(&r, tsc_freq, beg, end, count);
 	}
 
-	pin_to_core(0);
+	pin_to_core(placement_cpu(0));
 
 	// Read fs base 
 	if (rdwr[0]) {
@@ -111,10 +136,7 @@ void single_core_tests(int time, bool human, bool rdwr[2])
 		stop = false;
 		alarm(time);
 		beg = read_tsc();
-		while (!stop) {
-			tls_addr = rdfsbase();
-			count++;
-		}
+		count = loops.rdloop(&stop, &tls_addr);
 		dump_results("RD", human);
 	}
 
@@ -124,10 +146,7 @@ void single_core_tests(int time, bool human, bool rdwr[2])
 		stop = false;
 		alarm(time);
 		beg = read_tsc();
-		while (!stop) {
-			wrfsbase(tls_addr);
-			count++;
-		}
+		count = loops.wrloop(&stop, tls_addr);
 		dump_results("WR", human);
 	}
 }
@@ -141,85 +160,90 @@ void multi_core_tests(int ncpus, int time, bool human, bool rdwr[2])
 		bool done;
 		uint64_t beg_time;
 		uint64_t end_time;
+		int cpu;
 	} __attribute__((aligned(ARCH_CL_SIZE)));
 
 	static __thread int __tid;
-	static int barrier;
+	static struct tree_barrier barrier;
 	static void (*run_loop)(int);
 	static char *run_prefix;
 	static pthread_t thread;
 	static uint64_t tsc_freq;
-	static struct tdata *tdata;
-	static bool test_done;
-	tdata = aligned_alloc(ARCH_CL_SIZE, sizeof(struct tdata) * ncpus);
+	static struct tdata **tdata;
+	/* Each core's data lives on that core's node. */
+	tdata = malloc(sizeof(struct tdata*) * ncpus);
+	for (int i = 0; i < ncpus; i++)
+		tdata[i] = node_alloc(sizeof(struct tdata),
+		                      cpu_node(placement_cpu(i)));
 	tsc_freq = get_tsc_freq();
 
 	void dump_results(char *prefix, bool human)
 	{
 		if (human) {
 			printf("Multicore %s fsbase:\n", prefix);
+			print_topology(stdout, ncpus);
 			for (int i=0; i<ncpus; i++) {
-				printf("  Core %2d: ", i);
+				printf("  Core %2d (cpu %2d, node %d): ", i, tdata[i]->cpu,
+				       cpu_node(tdata[i]->cpu));
 				printf("    ops/s: %ld",
-				         tdata[i].count/tsc2msec(tdata[i].end_time 
-						                         - tdata[i].beg_time) * 1000);
+				         tdata[i]->count/tsc2msec(tdata[i]->end_time 
+						                         - tdata[i]->beg_time) * 1000);
 				printf("    latency: %ldns\n",
-				         tsc2nsec(tdata[i].end_time - tdata[i].beg_time)
-						 / tdata[i].count);
+				         tsc2nsec(tdata[i]->end_time - tdata[i]->beg_time)
+						 / tdata[i]->count);
 			}
 		} else {
 			for (int i=0; i<ncpus; i++)
-				printf("MC:%s:%d:%ld:%ld:%ld:%ld\n", prefix, i, tsc_freq,
-				       tdata[i].beg_time, tdata[i].end_time, tdata[i].count);
+				printf("MC:%s:%d:%ld:%ld:%ld:%ld:%d:%d\n", prefix, i, tsc_freq,
+				       tdata[i]->beg_time, tdata[i]->end_time, tdata[i]->count,
+				       tdata[i]->cpu, cpu_node(tdata[i]->cpu));
+		}
+		for (int i=0; i<ncpus && results_enabled(); i++) {
+			struct result r;
+			result_begin(&r, "MC");
+			result_param_str(&r, "mechanism", mechanism);
+			result_param_str(&r, "dispatch", dispatch);
+			result_param_str(&r, "op", prefix);
+			result_param_int(&r, "time", time);
+			result_param_int(&r, "ncpus", ncpus);
+			result_param_str(&r, "placement", topology.policy);
+			result_param_int(&r, "core", i);
+			result_param_int(&r, "cpu", tdata[i]->cpu);
+			result_param_int(&r, "node", cpu_node(tdata[i]->cpu));
+			record_timed(&r, tsc_freq, tdata[i]->beg_time, tdata[i]->end_time,
+			             tdata[i]->count);
 		}
 	}
 
 	void alarm_handler(int sig)
 	{
 		/* Stop my thread right away (for consistency with sc test) */
-		tdata[__tid].end_time = read_tsc();
-		tdata[__tid].stop = true;
+		tdata[__tid]->end_time = read_tsc();
 
-		/* Stop the other threads. */
-		for (int i=0; i<ncpus; i++) {
-			tdata[i].stop = true;
-			if (i != __tid) { 
-				while (!tdata[i].done)
-					cpu_relax();
-			}
-		}
-		dump_results(run_prefix, human);
-		test_done = true;
+		/* Stop the other threads.  Their counts only land in tdata once
+		 * their loops return, so thread 0 dumps the results after that. */
+		for (int i=0; i<ncpus; i++)
+			tdata[i]->stop = true;
 	}
 
 	void rdloop(int id) {
-		/* Pull these out to optimize the loop. */
-		volatile bool *stop = &tdata[id].stop;
-		uint64_t *count = &tdata[id].count;
-		void **tls_addr = tdata[id].tls_addr;
-
-		tdata[id].beg_time = read_tsc();
-		while (!*stop) {
-			*tls_addr = rdfsbase();
-			(*count)++;
-		}
-		tdata[id].end_time = read_tsc();
-		tdata[id].done = true;
+		tdata[id]->beg_time = read_tsc();
+		tdata[id]->count = loops.rdloop(&tdata[id]->stop,
+		                                &tdata[id]->tls_addr);
+		if (!tdata[id]->end_time)
+			tdata[id]->end_time = read_tsc();
+		cmb();
+		tdata[id]->done = true;
 	}
 
 	void wrloop(int id) {
-		/* Pull these out to optimize the loop. */
-		volatile bool *stop = &tdata[id].stop;
-		uint64_t *count = &tdata[id].count;
-		void **tls_addr = tdata[id].tls_addr;
-
-		tdata[id].beg_time = read_tsc();
-		while (!*stop) {
-			wrfsbase(*tls_addr);
-			(*count)++;
-		}
-		tdata[id].end_time = read_tsc();
-		tdata[id].done = true;
+		tdata[id]->beg_time = read_tsc();
+		tdata[id]->count = loops.wrloop(&tdata[id]->stop,
+		                                tdata[id]->tls_addr);
+		if (!tdata[id]->end_time)
+			tdata[id]->end_time = read_tsc();
+		cmb();
+		tdata[id]->done = true;
 	}
 
 	void *thread_handler(void *arg)
@@ -229,14 +253,13 @@ void multi_core_tests(int ncpus, int time, bool human, bool rdwr[2])
 
 		/* Pin to our core */
 		if (id != 0) {
-			tdata[id].tls_addr = inst_rdfsbase();
-			pin_to_core(id);
-			__sync_fetch_and_add(&barrier, 1);
-		}
+			tdata[id]->tls_addr = tls_switch.rdfsbase();
+			pin_to_core(placement_cpu(id));
+			tdata[id]->cpu = sched_getcpu();
 
-		/* Checkin and barrier waiting for all threads to come up. */
-		while (barrier < ncpus)
-			cmb();
+			/* Checkin and barrier waiting for all threads to come up. */
+			tree_barrier_wait(&barrier, id);
+		}
 
 		/* Run the loop. */
 		run_loop(id);
@@ -247,41 +270,44 @@ void multi_core_tests(int ncpus, int time, bool human, bool rdwr[2])
 		/* Set up the globals for the test */
 		run_prefix = prefix;
 		run_loop = test_func;
-		barrier = 0;
-		test_done = false;
+		tree_barrier_init(&barrier, ncpus, TREE_BARRIER_GATED);
 		for (int i=0; i<ncpus; i++) {
-			tdata[i].tls_addr = 0;
-			tdata[i].count = 0;
-			tdata[i].stop = 0;
-			tdata[i].done = 0;
-			tdata[i].beg_time = 0;
-			tdata[i].end_time= 0;
+			tdata[i]->tls_addr = 0;
+			tdata[i]->count = 0;
+			tdata[i]->stop = 0;
+			tdata[i]->done = 0;
+			tdata[i]->beg_time = 0;
+			tdata[i]->end_time= 0;
 		}
 		/* Spawn off 1 thread per core except for core 0. */
 		for (int i=1; i<ncpus; i++)
 			pthread_create(&thread, NULL, thread_handler, (void*)(long)i);
 		
 		/* Pin myself to core 0. */
-		pin_to_core(0);
+		pin_to_core(placement_cpu(0));
+
+		tdata[0]->cpu = sched_getcpu();
 
 		/* Grab my tls_desc */
-		tdata[0].tls_addr = inst_rdfsbase();
+		tdata[0]->tls_addr = tls_switch.rdfsbase();
 
 		/* Barrier waiting for all other threads to come up. */
-		while (barrier < (ncpus - 1))
-			pthread_yield();
+		tree_barrier_gather(&barrier, 0);
 
 		/* Set the alarm */
 		alarm(time);
 
 		/* Release the threads */
-		barrier++;
+		tree_barrier_release(&barrier);
 
 		/* Become thread 0 */
 		thread_handler(0);
 
-		while(!test_done)
-			cpu_relax();
+		for (int i=1; i<ncpus; i++)
+			while (!tdata[i]->done)
+				cpu_relax();
+		dump_results(run_prefix, human);
+		tree_barrier_destroy(&barrier);
 	}
 
 	/* Set up the alarm */
@@ -298,6 +324,333 @@ void multi_core_tests(int ncpus, int time, bool human, bool rdwr[2])
 		run_test("WR", time, wrloop);
 }
 
+/* The pieces of a user-level context switch, other than the fs base, each
+ * measured on its own so we can tell which of them dominates a yield. */
+#define XSAVE_AREA_SIZE 4096
+#define SWITCH_STACK_SIZE (64 * 1024)
+
+static uint64_t saved_regs[8];
+static char xsave_area[XSAVE_AREA_SIZE] __attribute__((aligned(64)));
+static uint64_t xsave_mask;
+static ucontext_t main_uctx, child_uctx;
+static void *main_sp, *child_sp;
+
+/* Save the registers a switch has to preserve across the call (the callee
+ * saved ones plus the stack pointer), and then restore them. */
+static void regs_switch(void)
+{
+	asm volatile("movq %%rbx,  0(%0)\n\t"
+	             "movq %%rbp,  8(%0)\n\t"
+	             "movq %%r12, 16(%0)\n\t"
+	             "movq %%r13, 24(%0)\n\t"
+	             "movq %%r14, 32(%0)\n\t"
+	             "movq %%r15, 40(%0)\n\t"
+	             "movq %%rsp, 48(%0)\n\t"
+	             "movq  0(%0), %%rbx\n\t"
+	             "movq  8(%0), %%rbp\n\t"
+	             "movq 16(%0), %%r12\n\t"
+	             "movq 24(%0), %%r13\n\t"
+	             "movq 32(%0), %%r14\n\t"
+	             "movq 40(%0), %%r15\n\t"
+	             "movq 48(%0), %%rsp\n\t"
+	             :: "r" (saved_regs) : "memory");
+}
+
+static void null_switch(void)
+{
+	cmb();
+}
+
+static void fxsave_switch(void)
+{
+	asm volatile("fxsave64 %0\n\t"
+	             "fxrstor64 %0"
+	             : "+m" (*(char (*)[512])xsave_area));
+}
+
+static void xsave_switch(void)
+{
+	asm volatile("xsave64 %0\n\t"
+	             "xrstor64 %0"
+	             : "+m" (*(char (*)[XSAVE_AREA_SIZE])xsave_area)
+	             : "a" ((uint32_t)xsave_mask), "d" ((uint32_t)(xsave_mask >> 32)));
+}
+
+static void xsaveopt_switch(void)
+{
+	asm volatile("xsaveopt64 %0\n\t"
+	             "xrstor64 %0"
+	             : "+m" (*(char (*)[XSAVE_AREA_SIZE])xsave_area)
+	             : "a" ((uint32_t)xsave_mask), "d" ((uint32_t)(xsave_mask >> 32)));
+}
+
+/* Round trip through a second context with glibc's swapcontext().  This does
+ * two switches (and two sigprocmask() calls) per op. */
+static void swapcontext_child(void)
+{
+	while (1)
+		swapcontext(&child_uctx, &main_uctx);
+}
+
+static void swapcontext_switch(void)
+{
+	swapcontext(&main_uctx, &child_uctx);
+}
+
+/* About the least a switch can do: push the callee saved registers, swap
+ * stacks, and pop them off the other stack.  Also two switches per op. */
+void min_switch(void **from_sp, void *to_sp);
+asm(".pushsection .text\n"
+    ".globl min_switch\n"
+    "min_switch:\n"
+    "	pushq %rbp\n"
+    "	pushq %rbx\n"
+    "	pushq %r12\n"
+    "	pushq %r13\n"
+    "	pushq %r14\n"
+    "	pushq %r15\n"
+    "	movq %rsp, (%rdi)\n"
+    "	movq %rsi, %rsp\n"
+    "	popq %r15\n"
+    "	popq %r14\n"
+    "	popq %r13\n"
+    "	popq %r12\n"
+    "	popq %rbx\n"
+    "	popq %rbp\n"
+    "	ret\n"
+    ".popsection\n");
+
+static void min_switch_child(void)
+{
+	while (1)
+		min_switch(&child_sp, main_sp);
+}
+
+static void min_switch_op(void)
+{
+	min_switch(&main_sp, child_sp);
+}
+
+static void init_switch_stacks(void)
+{
+	/* swapcontext() child */
+	getcontext(&child_uctx);
+	child_uctx.uc_stack.ss_sp = malloc(SWITCH_STACK_SIZE);
+	child_uctx.uc_stack.ss_size = SWITCH_STACK_SIZE;
+	child_uctx.uc_link = NULL;
+	makecontext(&child_uctx, swapcontext_child, 0);
+
+	/* min_switch() child.  Lay the stack out as if min_switch() had been
+	 * called from min_switch_child(): six zeroed registers, then the address
+	 * to 'ret' to, which has to leave the stack ABI aligned on entry. */
+	uintptr_t top = ((uintptr_t)malloc(SWITCH_STACK_SIZE)
+	                 + SWITCH_STACK_SIZE) & ~0xfUL;
+	uint64_t *sp = (uint64_t*)top;
+	*--sp = 0;
+	*--sp = (uint64_t)min_switch_child;
+	for (int i = 0; i < 6; i++)
+		*--sp = 0;
+	child_sp = sp;
+}
+
+/* Like the fs base ops, each switch gets its own copy of the loop so the
+ * switch is inlined into it. */
+#define DEFINE_SWITCH_LOOP(op) \
+static uint64_t op##_loop(volatile bool *stop) \
+{ \
+	uint64_t count = 0; \
+	while (!*stop) { \
+		op(); \
+		count++; \
+	} \
+	return count; \
+}
+
+DEFINE_SWITCH_LOOP(null_switch)
+DEFINE_SWITCH_LOOP(regs_switch)
+DEFINE_SWITCH_LOOP(fxsave_switch)
+DEFINE_SWITCH_LOOP(xsave_switch)
+DEFINE_SWITCH_LOOP(xsaveopt_switch)
+DEFINE_SWITCH_LOOP(swapcontext_switch)
+DEFINE_SWITCH_LOOP(min_switch_op)
+
+/* The xsave state components we can save here (XCR0), or 0 if the cpu or
+ * the kernel doesn't support xsave. */
+static uint64_t xsave_supported(bool *opt)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	*opt = false;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+		return 0;
+	if (__get_cpuid_count(0xd, 1, &eax, &ebx, &ecx, &edx))
+		*opt = eax & 0x1;
+	asm volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+void switch_tests(int time, bool human, bool which[7])
+{
+	uint64_t beg, end;
+	uint64_t count;
+	volatile bool stop;
+	uint64_t tsc_freq = get_tsc_freq();
+	bool have_xsaveopt;
+	uint64_t xcr0 = xsave_supported(&have_xsaveopt);
+	char name[32];
+
+	/* x87+SSE, then adding AVX, then adding the AVX-512 components. */
+	uint64_t masks[] = {0x3, 0x7, 0xe7};
+
+	void alarm_handler(int sig)
+	{
+		end = read_tsc();
+		stop = true;
+	}
+	struct sigaction act;
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = &alarm_handler;
+	act.sa_flags = 0;
+	sigaction(SIGALRM, &act, NULL);
+
+	void run_test(char *prefix, uint64_t (*loop)(volatile bool *stop))
+	{
+		stop = false;
+		alarm(time);
+		beg = read_tsc();
+		count = loop(&stop);
+		if (human) {
+			printf("Single core %s switch:\n", prefix);
+			printf("  Core %2d: ", 0);
+			printf("    ops/s: %ld", count/tsc2msec(end - beg) * 1000);
+			printf("    latency: %ldns, %ld cycles\n",
+			       tsc2nsec(end - beg)/count, (end - beg)/count);
+		} else {
+			printf("SC:%s:%ld:%ld:%ld:%ld\n", prefix, tsc_freq, beg, end,
+			       count);
+		}
+		struct result r;
+		result_begin(&r, "switch");
+		result_param_str(&r, "op", prefix);
+		result_param_int(&r, "time", time);
+		record_timed(&r, tsc_freq, beg, end, count);
+	}
+
+	pin_to_core(placement_cpu(0));
+	init_switch_stacks();
+
+	/* Dirty the AVX state so xsave has something to save; otherwise the
+	 * init optimization skips it. */
+	if ((xcr0 & 0x7) == 0x7)
+		asm volatile("vpcmpeqd %%ymm0, %%ymm0, %%ymm0" ::: "xmm0");
+
+	if (which[0])
+		run_test("null", null_switch_loop);
+	if (which[1])
+		run_test("regs", regs_switch_loop);
+	if (which[2])
+		run_test("fxsave", fxsave_switch_loop);
+	for (int i = 0; i < sizeof(masks)/sizeof(masks[0]); i++) {
+		if ((masks[i] & xcr0) != masks[i])
+			continue;
+		xsave_mask = masks[i];
+		if (which[3]) {
+			sprintf(name, "xsave-0x%lx", xsave_mask);
+			run_test(name, xsave_switch_loop);
+		}
+		if (which[4] && have_xsaveopt) {
+			sprintf(name, "xsaveopt-0x%lx", xsave_mask);
+			run_test(name, xsaveopt_switch_loop);
+		}
+	}
+	if (which[5])
+		run_test("swapcontext", swapcontext_switch_loop);
+	if (which[6])
+		run_test("min_switch", min_switch_op_loop);
+}
+
+/* How much TLS touching a bunch of different TLS blocks costs right after
+ * switching to them.  Each block is a copy of this thread's real static TLS
+ * block and TCB in its own pages, so the fs relative accesses a __thread
+ * variable turns into land in different memory for each one. */
+#define TLS_TOUCH_MAX (256 * 1024)
+#define TLS_TCB_COPY 0x100
+static __thread char tls_data[TLS_TOUCH_MAX] __attribute__((aligned(PGSIZE)));
+
+/* Go through %fs explicitly, the way a __thread access does, so the
+ * compiler can't hoist the address computation above the switch. */
+static inline uint64_t touch_tls(long tpoff, int size)
+{
+	uint64_t sum = 0;
+	for (long off = 0; off < size; off += ARCH_CL_SIZE) {
+		uint64_t v;
+		asm volatile("movq %%fs:(%1), %0" : "=r" (v) : "r" (tpoff + off));
+		sum += v;
+	}
+	return sum;
+}
+
+void tls_access_tests(int time, bool human, int max_blocks, int size)
+{
+	uint64_t tsc_freq = get_tsc_freq();
+	char *real_fs = tls_switch.rdfsbase();
+	long tpoff = tls_data - real_fs;
+	size_t span = -tpoff + TLS_TCB_COPY;
+	char **blocks = malloc(sizeof(char*) * max_blocks);
+	volatile uint64_t sink;
+
+	pin_to_core(placement_cpu(0));
+	size = MIN(MAX(size, 8), TLS_TOUCH_MAX);
+	memset(tls_data, 1, sizeof(tls_data));
+	for (int i = 0; i < max_blocks; i++) {
+		char *base = aligned_alloc(PGSIZE, (span + PGSIZE - 1) & ~(PGSIZE - 1));
+		memcpy(base, tls_data, span);
+		blocks[i] = base - tpoff;
+		/* The tcb and self pointers at fs:0 and fs:16 point to the block. */
+		((void**)blocks[i])[0] = blocks[i];
+		((void**)blocks[i])[2] = blocks[i];
+	}
+
+	for (int n = 1; n <= max_blocks; n *= 2) {
+		uint64_t count = 0, sum = 0;
+		uint64_t beg = read_tsc();
+		uint64_t deadline = beg + sec2tsc(time);
+		uint64_t end;
+
+		/* No signals or library calls while we're on a fake block; just
+		 * check the clock every so often. */
+		do {
+			for (int i = 0; i < 1024; i++) {
+				tls_switch.wrfsbase(blocks[i & (n - 1)]);
+				sum += touch_tls(tpoff, size);
+			}
+			count += 1024;
+		} while ((end = read_tsc()) < deadline);
+		tls_switch.wrfsbase(real_fs);
+		sink = sum;
+
+		if (human) {
+			printf("TLS blocks: %4d, touch: %6dB: ", n, size);
+			printf("    ops/s: %ld", count/tsc2msec(end - beg) * 1000);
+			printf("    latency: %ldns, %ld cycles\n",
+			       tsc2nsec(end - beg)/count, (end - beg)/count);
+		} else {
+			printf("TLS:%d:%d:%ld:%ld:%ld:%ld\n", n, size, tsc_freq, beg,
+			       end, count);
+		}
+		struct result r;
+		result_begin(&r, "TLS");
+		result_param_str(&r, "mechanism", tls_switch.name);
+		result_param_int(&r, "blocks", n);
+		result_param_int(&r, "size", size);
+		result_param_int(&r, "time", time);
+		record_timed(&r, tsc_freq, beg, end, count);
+	}
+	for (int i = 0; i < max_blocks; i++)
+		free(blocks[i] + tpoff);
+	free(blocks);
+}
+
 void print_header(char *name, int ncpus, int time, bool human)
 {
 	if (human)
@@ -314,6 +667,10 @@ int main (int argc, char **argv)
 	bool tests[3] = {[0 ... 2] = true};
 	bool scmc[2] = {[0 ... 1] = true};
 	bool rdwr[2] = {[0 ... 1] = true};
+	bool switches[7] = {[0 ... 6] = true};
+	int tls_blocks = 0;
+	int tls_size = ARCH_CL_SIZE;
+	bool indirect = false;
 
 	if (argc > 1)
 		ncpus = strtol(argv[1], 0, 10);										  
@@ -334,35 +691,83 @@ int main (int argc, char **argv)
 		rdwr[0] = argv[6][0] - '0';
 		rdwr[1] = argv[6][1] - '0';
 	}
+	if (argc > 7) {
+		for (int i = 0; i < 7 && argv[7][i]; i++)
+			switches[i] = argv[7][i] - '0';
+	}
+	if (argc > 8)
+		tls_blocks = strtol(argv[8], 0, 10);
+	if (argc > 9)
+		tls_size = strtol(argv[9], 0, 10);
+	if (argc > 10)
+		indirect = strtol(argv[10], 0, 10);
+
+	topology_init();
+	results_init("fsbase-test", argc, argv);
+	result_topology();
+	if (!human)
+		print_topology(stderr, ncpus);
+
+	/* Find out which fs base mechanisms we can use. */
+	const char *tls_path = tls_switch_init();
+	fprintf(human ? stdout : stderr, "tls switch: %s\n", tls_path);
+	if (tests[1] && !have_fsgsbase()) {
+		fprintf(stderr, "rd/wrfsbase not enabled by this cpu/kernel, "
+		                "skipping those tests\n");
+		tests[1] = false;
+	}
 
-	if (tests[0]) {
-		print_header("baseline", ncpus, time, human);
-		rdfsbase = null_rdfsbase;
-		wrfsbase = null_wrfsbase;
+	struct {
+		char *name;
+		char *indirect_name;
+		void *(*rdfsbase)(void);
+		void (*wrfsbase)(void *tls_addr);
+		struct fsbase_loops loops;
+	} mechs[3] = {
+		{"baseline", "baseline-indirect", null_rdfsbase, null_wrfsbase,
+		 FSBASE_LOOPS(null)},
+		{"rd/wrfsbase", "rd/wrfsbase-indirect", inst_rdfsbase, inst_wrfsbase,
+		 FSBASE_LOOPS(inst)},
+		{"arch_prctl", "arch_prctl-indirect", sys_rdfsbase, sys_wrfsbase,
+		 FSBASE_LOOPS(sys)},
+	};
+	struct fsbase_loops indirect_loops = FSBASE_LOOPS(indirect);
+
+	void fsbase_tests(char *name, struct fsbase_loops *l)
+	{
+		print_header(name, ncpus, time, human);
+		loops = *l;
 		if (scmc[0])
 			single_core_tests(time, human, rdwr);
 		if (scmc[1])
 			multi_core_tests(ncpus, time, human, rdwr);
 	}
 
-	if (tests[1]) {
-		print_header("rd/wrfsbase", ncpus, time, human);
-		rdfsbase = inst_rdfsbase;
-		wrfsbase = inst_wrfsbase;
-		if (scmc[0])
-			single_core_tests(time, human, rdwr);
-		if (scmc[1])
-			multi_core_tests(ncpus, time, human, rdwr);
+	for (int i = 0; i < 3; i++) {
+		if (!tests[i])
+			continue;
+		mechanism = mechs[i].name;
+		rdfsbase = mechs[i].rdfsbase;
+		wrfsbase = mechs[i].wrfsbase;
+		dispatch = "inline";
+		fsbase_tests(mechs[i].name, &mechs[i].loops);
+		if (indirect) {
+			dispatch = "indirect";
+			fsbase_tests(mechs[i].indirect_name, &indirect_loops);
+		}
 	}
 
-	if (tests[2]) {
-		print_header("arch_prctl", ncpus, time, human);
-		rdfsbase = sys_rdfsbase;
-		wrfsbase = sys_wrfsbase;
-		if (scmc[0])
-			single_core_tests(time, human, rdwr);
-		if (scmc[1])
-			multi_core_tests(ncpus, time, human, rdwr);
+	for (int i = 0; i < 7; i++) {
+		if (switches[i]) {
+			print_header("switch", 1, time, human);
+			switch_tests(time, human, switches);
+			break;
+		}
+	}
+
+	if (tls_blocks) {
+		print_header("tls_access", 1, time, human);
+		tls_access_tests(time, human, tls_blocks, tls_size);
 	}
 }
 
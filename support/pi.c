@@ -5,85 +5,211 @@
  *      Every thread computes a number of points in the unit square
  *      and returns the number of hits in the quarter circle
  *      pi is  #hits/#total * 4
- *      
+ *
+ *      Threads yield every 'yield_every' points, so varying it against the
+ *      number of threads trades compute density for scheduler work.
+ *
  *      usage:
- *      pi 
+ *      pi [nr_threads] [nr_points] [yield_every] [use_avx2] [human]
+ *         [preempt_period]
  *
  */
 
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
 #include "../libconfig.h"
+#include "../results.h"
+
+/* Modifiable via command line */
+int nr_threads = 10000;             /* number of worker threads */
+long nr_points = 10000;             /* total number of points */
+long yield_every = 1;               /* points between yields, 0 for never */
+int use_avx2 = 0;                   /* use the vectorized sampling kernel */
+int human = 1;
+int preempt_period = PREEMPT_PERIOD;
+
+long mypoints;                      /* number of points per thread */
+
+/* Each thread's PRNG state and result, on its own cache line.  The four
+ * xorshift lanes feed the four doubles of the AVX2 kernel; the scalar kernel
+ * only uses lane 0. */
+struct tdata {
+	uint64_t rng[4];
+	long hits;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+pthread_t *thandles = NULL;
+struct tdata *tdata = NULL;
+
+static inline uint64_t xorshift64(uint64_t *s)
+{
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+/* Turn the top 52 random bits into a double in [0, 1). */
+static inline double to_unit(uint64_t r)
+{
+	union { uint64_t u; double d; } v = { (r >> 12) | 0x3ff0000000000000UL };
+	return v.d - 1.0;
+}
+
+static long sample_scalar(struct tdata *t, long n)
+{
+	long hits = 0;
+	for (long i = 0; i < n; i++) {
+		double x = to_unit(xorshift64(&t->rng[0]));
+		double y = to_unit(xorshift64(&t->rng[0]));
+		hits += (x*x + y*y <= 1.0);
+	}
+	return hits;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xorshift64_avx2(__m256i *s)
+{
+	__m256i x = *s;
+	x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 7));
+	x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 17));
+	return *s = x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256d to_unit_avx2(__m256i r)
+{
+	__m256i bits = _mm256_or_si256(_mm256_srli_epi64(r, 12),
+	                               _mm256_set1_epi64x(0x3ff0000000000000UL));
+	return _mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(1.0));
+}
 
-#define NUM_THREADS 10000         /* number of worker threads */
-#define NUM_POINTS  10000L        /* number of points */
+/* Four points per step; any remainder goes through the scalar kernel. */
+__attribute__((target("avx2")))
+static long sample_avx2(struct tdata *t, long n)
+{
+	long hits = 0;
+	__m256i s = _mm256_loadu_si256((__m256i*)t->rng);
+	__m256d one = _mm256_set1_pd(1.0);
+	for (long i = 0; i < n / 4; i++) {
+		__m256d x = to_unit_avx2(xorshift64_avx2(&s));
+		__m256d y = to_unit_avx2(xorshift64_avx2(&s));
+		__m256d d = _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y));
+		int mask = _mm256_movemask_pd(_mm256_cmp_pd(d, one, _CMP_LE_OQ));
+		hits += __builtin_popcount(mask);
+	}
+	_mm256_storeu_si256((__m256i*)t->rng, s);
+	return hits + sample_scalar(t, n % 4);
+}
 
-long mypoints;                     /* number of points per thread */
+static void parse_args(int argc, char **argv)
+{
+	if (argc > 1)
+		nr_threads = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		nr_points = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		yield_every = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		use_avx2 = strtol(argv[4], 0, 10);
+	if (argc > 5)
+		human = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		preempt_period = strtol(argv[6], 0, 10);
+}
 
-void 
-main(int argc, char *argv[])
+void *calc(void *arg)
 {
+	/*
+	 * compute total random points in the unit square
+	 * and count the number of hits in the sector (x*x + y*y < 1)
+	 *
+	 * uses global mypoints
+	 */
+	struct tdata *t = &tdata[(long)arg];
+	long chunk = yield_every ? yield_every : mypoints;
 
-   int        i;
-   int        nthreads;                      /* number of threads */
-   long       npoints;                       /* total number of points */
-   pthread_t  thread_id[NUM_THREADS];        /* ids of all threads */
-   long       totalhits = 0;                 /* total number of hits */
-   double     pi;                            /* result */
-   void *     myhits_p;
-   void *     calc(void *);                  /* calculation */
-
-   nthreads = NUM_THREADS;
-   npoints = NUM_POINTS;
-   mypoints = (long) ceil(npoints/nthreads);
-   npoints = nthreads * mypoints;              /* correct total */
-   
-   /* start worker threads */
-   for (i=0; i<nthreads; i++) {
-     pthread_create(&thread_id[i], NULL, calc, NULL);
-   }   
-
-   /*  wait for worker threads and combine partial results */
-   for (i=0; i<nthreads; i++) {
-     pthread_join(thread_id[i], &myhits_p);
-     totalhits +=  * (long *)myhits_p;
-   }   
-   
-   /* compute final result */
-   pi = totalhits/(double)npoints*4;
-   printf("\nPI = %lf\n", pi);
+	for (long done = 0; done < mypoints; done += chunk) {
+		long n = MIN(chunk, mypoints - done);
+		t->hits += use_avx2 ? sample_avx2(t, n) : sample_scalar(t, n);
+		if (yield_every)
+			pthread_yield();
+	}
+	return NULL;
 }
 
-void * calc(void *args)
+int main(int argc, char *argv[])
 {
-   /* 
-    * compute total random points in the unit square
-    * and return the number of hits in the sector (x*x + y*y < 1)
-    *
-    * uses global mypoints
-    */
-
-   double  x, y;                     /* random coordinates */
-   long *  hits_p;                   /* pointer to number of hits */
-   int     seed;                     /* seed for random generator */
-   long    i;
-   
-   /* get memory for return value */
-   hits_p = (long *) calloc(1, sizeof(long));        /* initialized  to 0 */
-
-   /* initialize random generator (otherwise all return the same result!) */
-   seed = (int) pthread_id();
-   for(i=0; i<mypoints; i++) {
-      x = ((double) rand_r(&seed))/RAND_MAX;
-      y = ((double) rand_r(&seed))/RAND_MAX;
-      pthread_yield();
-      
-      if ( x*x + y*y <= 1.0 ) {
-         (*hits_p)++;
-      }
-   }
-
-   return(hits_p); 
+	long totalhits = 0;                /* total number of hits */
+	double pi;                         /* result */
+
+	parse_args(argc, argv);
+	results_init("pi", argc, argv);
+	if (use_avx2 && !__builtin_cpu_supports("avx2")) {
+		fprintf(stderr, "AVX2 not supported, using the scalar kernel\n");
+		use_avx2 = 0;
+	}
+	mypoints = (nr_points + nr_threads - 1) / nr_threads;
+	nr_points = nr_threads * mypoints;   /* correct total */
+
+	thandles = calloc(nr_threads, sizeof(pthread_t));
+	tdata = aligned_alloc(ARCH_CL_SIZE, sizeof(struct tdata) * nr_threads);
+	memset(tdata, 0, sizeof(struct tdata) * nr_threads);
+	/* initialize random generators (otherwise all return the same result!) */
+	for (int i = 0; i < nr_threads; i++)
+		for (int j = 0; j < 4; j++)
+			tdata[i].rng[j] = 0x9e3779b97f4a7c15UL * (4 * i + j + 1);
+
+	/* Do any library specific test prep */
+	test_prep();
+
+	/* start worker threads */
+	uint64_t beg = read_tsc();
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&thandles[i], NULL, calc, (void*)(long)i);
+
+	/* wait for worker threads and combine partial results */
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(thandles[i], NULL);
+		totalhits += tdata[i].hits;
+	}
+	uint64_t end = read_tsc();
+
+	/* compute final result */
+	pi = totalhits/(double)nr_points*4;
+	if (human) {
+		printf("PI = %lf\n", pi);
+		printf("threads: %d, points: %ld, yield every: %ld, kernel: %s\n",
+		       nr_threads, nr_points, yield_every,
+		       use_avx2 ? "avx2" : "scalar");
+		printf("Total time: %ldms (%ldns per point)\n", tsc2msec(end - beg),
+		       tsc2nsec(end - beg) / nr_points);
+	} else {
+		printf("pi:%d:%ld:%ld:%d:%ld:%ld:%ld:%ld\n", nr_threads, nr_points,
+		       yield_every, use_avx2, get_tsc_freq(), beg, end, totalhits);
+	}
+
+	struct result r;
+	result_begin(&r, "pi");
+	result_param_int(&r, "nr_threads", nr_threads);
+	result_param_int(&r, "nr_points", nr_points);
+	result_param_int(&r, "yield_every", yield_every);
+	result_param_int(&r, "avx2", use_avx2);
+	result_param_int(&r, "preempt_period", preempt_period);
+	result_metric_int(&r, "tsc_freq", get_tsc_freq());
+	result_metric_int(&r, "beg", beg);
+	result_metric_int(&r, "end", end);
+	result_metric_int(&r, "hits", totalhits);
+	result_metric_double(&r, "pi", pi);
+	result_end(&r);
+	return 0;
 }
@@ -70,6 +70,10 @@ def graph_rdwrfsbase_helper(bdata, config, which):
   labels = [0]*3
   for l in bdata.data.keys():
     for t in bdata.data[l].keys():
+      # The function pointer variants are for checking the numbers, not
+      # for these graphs.
+      if t.endswith('-indirect'):
+        continue
       avgs = []
       vars = []
       for v in sorted(bdata.data[l][t].keys()):
@@ -0,0 +1,252 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Cost and resolution of the clocks we time things with.  Each of
+ * 'nr_threads' threads, one per cpu, reads every clock 'iterations' times in
+ * a row, all threads on the same clock at once.  For each clock we report:
+ *
+ *   cost       - time per read, averaged over the threads (and the slowest
+ *                thread's), measured with serialized tsc reads around the
+ *                whole loop
+ *   resolution - the smallest nonzero step between back to back reads
+ *   repeats    - back to back reads that returned the same value
+ *   backwards  - back to back reads where time went backwards
+ *
+ * The tsc reads are specialized into their own loops rather than called
+ * through a pointer, since a call costs about as much as an rdtsc.  The
+ * clock_gettime() and gettimeofday() numbers depend on the kernel's
+ * clocksource, which we print: with tsc they stay in the vDSO, with
+ * anything else they trap into the kernel.
+ *
+ * usage: timing-test [nr_threads] [iterations] [human] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../topology.h"
+#include "../results.h"
+
+/* Modifiable via command line */
+int nr_threads = 1;
+long iterations = 1000000;
+int human = 1;
+
+static inline uint64_t read_rdtsc(void)
+{
+	return read_tsc();
+}
+
+static inline uint64_t read_rdtscp(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtscp" : "=a"(lo), "=d"(hi) : : "rcx");
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t read_lfence_rdtsc(void)
+{
+	uint32_t lo, hi;
+	asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t read_serialized(void)
+{
+	return read_tsc_serialized();
+}
+
+static inline uint64_t read_clock(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t read_monotonic(void)
+{
+	return read_clock(CLOCK_MONOTONIC);
+}
+
+static inline uint64_t read_monotonic_raw(void)
+{
+	return read_clock(CLOCK_MONOTONIC_RAW);
+}
+
+static inline uint64_t read_realtime(void)
+{
+	return read_clock(CLOCK_REALTIME);
+}
+
+static inline uint64_t read_gettimeofday(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000ULL + tv.tv_usec) * 1000;
+}
+
+struct sample {
+	uint64_t beg;
+	uint64_t end;
+	uint64_t min_step;
+	uint64_t repeats;
+	uint64_t backwards;
+	uint64_t sink;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* One loop per clock, so each read is inlined.  Values are in tsc ticks for
+ * the tsc clocks and nanoseconds for the rest. */
+#define DEFINE_MEASURE(clock) \
+static void measure_##clock(struct sample *s) \
+{ \
+	uint64_t last = read_##clock(), sink = 0; \
+	s->min_step = UINT64_MAX; \
+	s->beg = read_tsc_serialized(); \
+	for (long i = 0; i < iterations; i++) { \
+		uint64_t now = read_##clock(); \
+		if (now > last) \
+			s->min_step = MIN(s->min_step, now - last); \
+		else if (now == last) \
+			s->repeats++; \
+		else \
+			s->backwards++; \
+		sink ^= now; \
+		last = now; \
+	} \
+	s->end = read_tsc_serialized(); \
+	s->sink = sink; \
+}
+
+DEFINE_MEASURE(rdtsc)
+DEFINE_MEASURE(rdtscp)
+DEFINE_MEASURE(lfence_rdtsc)
+DEFINE_MEASURE(serialized)
+DEFINE_MEASURE(monotonic)
+DEFINE_MEASURE(monotonic_raw)
+DEFINE_MEASURE(realtime)
+DEFINE_MEASURE(gettimeofday)
+
+static struct clock {
+	const char *name;
+	bool tsc;
+	void (*measure)(struct sample *s);
+} clocks[] = {
+	{"rdtsc", true, measure_rdtsc},
+	{"rdtscp", true, measure_rdtscp},
+	{"lfence_rdtsc", true, measure_lfence_rdtsc},
+	{"serialized", true, measure_serialized},
+	{"monotonic", false, measure_monotonic},
+	{"monotonic_raw", false, measure_monotonic_raw},
+	{"realtime", false, measure_realtime},
+	{"gettimeofday", false, measure_gettimeofday},
+};
+#define NR_CLOCKS (sizeof(clocks) / sizeof(clocks[0]))
+
+static struct sample (*samples)[NR_CLOCKS];
+static pthread_barrier_t barrier;
+
+static void *timing_thread(void *arg)
+{
+	int id = (int)(long)arg;
+
+	pin_to_core(placement_cpu(id));
+	for (int c = 0; c < NR_CLOCKS; c++) {
+		pthread_barrier_wait(&barrier);
+		clocks[c].measure(&samples[id][c]);
+	}
+	return NULL;
+}
+
+static void read_clocksource(char *buf, size_t len)
+{
+	FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/"
+	                "current_clocksource", "r");
+	snprintf(buf, len, "unknown");
+	if (f) {
+		if (fgets(buf, len, f))
+			buf[strcspn(buf, "\n")] = 0;
+		fclose(f);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char clocksource[64];
+
+	if (argc > 1)
+		nr_threads = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		iterations = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		human = strtol(argv[3], 0, 10);
+
+	topology_init();
+	results_init("timing-test", argc, argv);
+	read_clocksource(clocksource, sizeof(clocksource));
+	samples = aligned_alloc(ARCH_CL_SIZE, sizeof(*samples) * nr_threads);
+	memset(samples, 0, sizeof(*samples) * nr_threads);
+
+	pthread_t *thandles = calloc(nr_threads, sizeof(pthread_t));
+	pthread_barrier_init(&barrier, NULL, nr_threads);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&thandles[i], NULL, timing_thread, (void*)(long)i);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(thandles[i], NULL);
+
+	uint64_t tsc_freq = get_tsc_freq();
+	if (human)
+		printf("Clocks (clocksource: %s): %d threads, %ld reads each\n",
+		       clocksource, nr_threads, iterations);
+	for (int c = 0; c < NR_CLOCKS; c++) {
+		double cost = 0, max_cost = 0;
+		uint64_t min_step = UINT64_MAX, repeats = 0, backwards = 0;
+		for (int i = 0; i < nr_threads; i++) {
+			struct sample *s = &samples[i][c];
+			double ns = (double)(s->end - s->beg) * 1e9 / tsc_freq / iterations;
+			cost += ns / nr_threads;
+			max_cost = MAX(max_cost, ns);
+			min_step = MIN(min_step, s->min_step);
+			repeats += s->repeats;
+			backwards += s->backwards;
+
+			struct result r;
+			result_begin(&r, clocks[c].name);
+			result_param_int(&r, "nr_threads", nr_threads);
+			result_param_int(&r, "thread", i);
+			result_param_int(&r, "cpu", placement_cpu(i));
+			result_param_str(&r, "clocksource", clocksource);
+			result_param_str(&r, "placement", topology.policy);
+			result_metric_int(&r, "tsc_freq", tsc_freq);
+			result_metric_int(&r, "beg", s->beg);
+			result_metric_int(&r, "end", s->end);
+			result_metric_int(&r, "count", iterations);
+			result_metric_int(&r, "repeats", s->repeats);
+			result_metric_int(&r, "backwards", s->backwards);
+			result_metric_double(&r, "resolution_ns", clocks[c].tsc
+			                     ? s->min_step * 1e9 / tsc_freq
+			                     : (double)s->min_step);
+			result_end(&r);
+		}
+		double resolution = clocks[c].tsc ? min_step * 1e9 / tsc_freq
+		                                  : (double)min_step;
+		double repeat_pct = 100.0 * repeats / ((double)iterations * nr_threads);
+		if (human) {
+			printf("  %-14s cost %8.1fns (max %8.1fns)  resolution %8.1fns  "
+			       "repeats %5.1f%%  backwards %ld\n", clocks[c].name, cost,
+			       max_cost, resolution, repeat_pct, backwards);
+		} else {
+			printf("%s:%s:%d:%ld:%.2f:%.2f:%.2f:%.2f:%ld\n", clocks[c].name,
+			       clocksource, nr_threads, iterations, cost, max_cost,
+			       resolution, repeat_pct, backwards);
+		}
+	}
+	return 0;
+}
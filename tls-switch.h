@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* Ways of reading and writing the fs base (i.e. switching TLS), and a
+ * tls_switch_init() that picks the fastest one this machine can actually run.
+ * The rd/wrfsbase instructions need both cpu support and the kernel to have
+ * set CR4.FSGSBASE (Linux 5.9+ advertises this in AT_HWCAP2); without the
+ * latter they SIGILL, so we fall back to arch_prctl(). */
+
+#ifndef BENCHMARKS_TLS_SWITCH_H
+#define BENCHMARKS_TLS_SWITCH_H
+
+#include <stdbool.h>
+#include <cpuid.h>
+#include <sys/auxv.h>
+#include <asm/prctl.h>
+#include <sys/prctl.h>
+
+#ifndef AT_HWCAP2
+#define AT_HWCAP2 26
+#endif
+#ifndef HWCAP2_FSGSBASE
+#define HWCAP2_FSGSBASE (1 << 1)
+#endif
+
+static inline void *inst_rdfsbase(void)
+{
+	void *fs;
+	asm volatile(".byte 0xf3,0x48,0x0f,0xae,0xc0 # rdfsbaseq %%rax"
+	             : "=a" (fs)
+	             :: "memory");
+	return fs;
+}
+
+static inline void inst_wrfsbase(void *fs)
+{
+	asm volatile(".byte 0xf3,0x48,0x0f,0xae,0xd0 # wrfsbaseq %%rax"
+	             :: "a" (fs)
+	             : "memory");
+}
+
+static inline void *sys_rdfsbase(void)
+{
+	int arch_prctl(int code, unsigned long *addr);
+	unsigned long fs;
+	arch_prctl(ARCH_GET_FS, &fs);
+	return (void*)fs;
+}
+
+static inline void sys_wrfsbase(void *fs)
+{
+	int arch_prctl(int code, unsigned long *addr);
+	arch_prctl(ARCH_SET_FS, (unsigned long*)fs);
+}
+
+/* Does the cpu have rd/wrfsbase, and has the kernel turned them on? */
+static inline bool have_fsgsbase(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ebx & bit_FSGSBASE))
+		return false;
+	return getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE;
+}
+
+struct tls_switch_ops {
+	const char *name;
+	void *(*rdfsbase)(void);
+	void (*wrfsbase)(void *tls_addr);
+};
+
+static struct tls_switch_ops tls_switch = {
+	"arch_prctl", sys_rdfsbase, sys_wrfsbase
+};
+
+/* Pick the fastest mechanism we can use and return its name. */
+static inline const char *tls_switch_init(void)
+{
+	if (have_fsgsbase()) {
+		tls_switch.name = "wrfsbase";
+		tls_switch.rdfsbase = inst_rdfsbase;
+		tls_switch.wrfsbase = inst_wrfsbase;
+	}
+	return tls_switch.name;
+}
+
+#endif /* BENCHMARKS_TLS_SWITCH_H */
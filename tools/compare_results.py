@@ -0,0 +1,211 @@
+#!/usr/bin/env python
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Compare the structured results of a set of runs against a baseline, e.g.
+# nightly results from before and after a kernel or parlib upgrade:
+#
+#   compare_results.py baseline/ candidate/
+#
+# Records are grouped by benchmark, library, test and params (minus the ones
+# that just say which core or thread a record came from), and each run
+# (run_id) contributes one sample per group:
+#
+#   ops_per_sec - sum over the group's records of count / (end - beg)
+#   ns_per_op   - mean over the group's records of (end - beg) / count
+#   elapsed_s   - longest (end - beg) in the group, for tests without a count,
+#                 or time_s as reported (NPB)
+#   run_ms      - as reported (fixedwork)
+#   ops_per_cpu_s - as reported, work done per second of cpu time burned
+#   *pNN_ns     - latency percentiles as reported (p50_ns, latency_p99_ns,
+#                 ...), the worst of the group's records; lower is better.
+#                 The jitter samplers' own records aren't compared.
+#
+# Each metric is compared with a two-sided Mann-Whitney U test and a
+# bootstrap confidence interval on the change in the median.  A metric has
+# regressed when the change is significant (p < --alpha) and worse than
+# --threshold percent.  Exits with 1 if anything regressed.
+
+from __future__ import print_function
+import re
+import sys
+import math
+import random
+import argparse
+from collections import defaultdict
+
+import results
+
+# Params that only identify a record within a run.  fixedwork's seed is the
+# iteration number in run-fixedwork, so it says which run this is, not what
+# was measured.
+PER_RECORD_PARAMS = set(['core', 'cpu', 'node', 'thread', 'id', 'seed'])
+
+# Whether bigger is better for each derived metric.
+HIGHER_IS_BETTER = {
+  'ops_per_sec': True,
+  'ns_per_op': False,
+  'elapsed_s': False,
+  'run_ms': False,
+  'ops_per_cpu_s': True,
+}
+
+# Latency percentiles the benchmarks record, like p99_ns or latency_p50_ns.
+PERCENTILE_RE = re.compile(r'^(.*_)?p[0-9]+_ns$')
+
+# Records that describe the machine rather than the benchmark.
+SKIP_TESTS = set(['jitter'])
+
+def higher_is_better(metric):
+  return HIGHER_IS_BETTER.get(metric, False)
+
+def config_key(r):
+  params = tuple(sorted((k[len('params.'):], v) for k, v in r.items()
+                        if k.startswith('params.')
+                        and k[len('params.'):] not in PER_RECORD_PARAMS))
+  return (r['benchmark'], r['library'], r['test'], params)
+
+def derive(records):
+  """Map config -> metric -> list of per-run samples."""
+  runs = defaultdict(list)
+  for r in records:
+    runs[(config_key(r), r['run_id'])].append(r)
+
+  samples = defaultdict(lambda: defaultdict(list))
+  for (key, run_id), recs in runs.items():
+    ops = elapsed = run_ms = per_cpu = None
+    latencies = []
+    percentiles = {}
+    for r in recs:
+      if r['test'] in SKIP_TESTS:
+        continue
+      for k, v in r.items():
+        name = k[len('metrics.'):]
+        if (k.startswith('metrics.') and v is not None
+            and PERCENTILE_RE.match(name)):
+          percentiles[name] = max(percentiles.get(name, v), v)
+      freq = float(r.get('metrics.tsc_freq') or r.get('machine.tsc_freq', 0))
+      beg, end = r.get('metrics.beg'), r.get('metrics.end')
+      if freq and beg is not None and end is not None and end > beg:
+        secs = (end - beg) / freq
+        if r.get('metrics.count'):
+          ops = (ops or 0) + r['metrics.count'] / secs
+          latencies.append(secs * 1e9 / r['metrics.count'])
+        elif 'metrics.count' not in r:
+          elapsed = max(elapsed or 0, secs)
+      # Metrics that came out non-finite are written as null.
+      if r.get('metrics.time_s') is not None:
+        elapsed = max(elapsed or 0, r['metrics.time_s'])
+      if r.get('metrics.run_ms') is not None:
+        run_ms = r['metrics.run_ms']
+      if r.get('metrics.ops_per_cpu_s') is not None:
+        per_cpu = r['metrics.ops_per_cpu_s']
+    ns = sum(latencies) / len(latencies) if latencies else None
+    for name, val in (('ops_per_sec', ops), ('ns_per_op', ns),
+                      ('elapsed_s', elapsed), ('run_ms', run_ms),
+                      ('ops_per_cpu_s', per_cpu)):
+      if val is not None:
+        samples[key][name].append(val)
+    for name, val in percentiles.items():
+      samples[key][name].append(val)
+  return samples
+
+def median(xs):
+  xs = sorted(xs)
+  n = len(xs)
+  return xs[n // 2] if n % 2 else (xs[n // 2 - 1] + xs[n // 2]) / 2.0
+
+def mann_whitney(a, b):
+  """Two-sided p-value of the Mann-Whitney U test, using the normal
+     approximation with a tie correction."""
+  n1, n2 = len(a), len(b)
+  combined = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+  ranks = [0.0] * len(combined)
+  ties = 0.0
+  i = 0
+  while i < len(combined):
+    j = i
+    while j + 1 < len(combined) and combined[j + 1][0] == combined[i][0]:
+      j += 1
+    for k in range(i, j + 1):
+      ranks[k] = (i + j) / 2.0 + 1
+    t = j - i + 1
+    ties += t ** 3 - t
+    i = j + 1
+  r1 = sum(rank for rank, (v, g) in zip(ranks, combined) if g == 0)
+  u = r1 - n1 * (n1 + 1) / 2.0
+  n = n1 + n2
+  sigma = math.sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1))))
+  if sigma == 0:
+    return 1.0
+  z = (abs(u - n1 * n2 / 2.0) - 0.5) / sigma
+  return min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+def bootstrap_ci(a, b, iters, level):
+  """Confidence interval on the relative change in the median from a to b."""
+  rng = random.Random(0)
+  changes = []
+  for _ in range(iters):
+    ma = median([rng.choice(a) for _ in a])
+    mb = median([rng.choice(b) for _ in b])
+    if ma:
+      changes.append((mb - ma) / ma)
+  changes.sort()
+  lo = changes[int((1 - level) / 2 * len(changes))]
+  hi = changes[min(len(changes) - 1, int((1 + level) / 2 * len(changes)))]
+  return lo, hi
+
+def describe(key):
+  benchmark, library, test, params = key
+  return "%s/%s/%s %s" % (benchmark, library, test,
+                          ' '.join("%s=%s" % p for p in params))
+
+def main():
+  parser = argparse.ArgumentParser(
+    description='Compare benchmark results against a baseline.')
+  parser.add_argument('baseline', help='baseline results file or directory')
+  parser.add_argument('candidate', help='candidate results file or directory')
+  parser.add_argument('--threshold', type=float, default=5.0,
+                      help='percent change that counts as a regression')
+  parser.add_argument('--alpha', type=float, default=0.05,
+                      help='significance level')
+  parser.add_argument('--min-samples', type=int, default=3,
+                      help='runs needed on each side to compare a metric')
+  parser.add_argument('--bootstrap', type=int, default=2000,
+                      help='bootstrap resamples for the confidence interval')
+  parser.add_argument('--verbose', '-v', action='store_true',
+                      help='report every metric, not just regressions')
+  args = parser.parse_args()
+
+  base = derive(results.load([args.baseline]))
+  cand = derive(results.load([args.candidate]))
+
+  regressions = compared = skipped = 0
+  for key in sorted(set(base) & set(cand)):
+    for metric in sorted(set(base[key]) & set(cand[key])):
+      a, b = base[key][metric], cand[key][metric]
+      if min(len(a), len(b)) < args.min_samples:
+        skipped += 1
+        continue
+      compared += 1
+      ma, mb = median(a), median(b)
+      change = (mb - ma) / ma if ma else 0.0
+      worse = -change if higher_is_better(metric) else change
+      p = mann_whitney(a, b)
+      lo, hi = bootstrap_ci(a, b, args.bootstrap, 1 - args.alpha)
+      regressed = p < args.alpha and worse * 100 > args.threshold
+      regressions += regressed
+      if regressed or args.verbose:
+        print("%-10s %s %s: %.4g -> %.4g (%+.1f%%, %d%% CI [%+.1f%%, %+.1f%%],"
+              " p=%.3g, n=%d/%d)" %
+              ("REGRESSED" if regressed else "ok", describe(key), metric,
+               ma, mb, change * 100, round((1 - args.alpha) * 100),
+               lo * 100, hi * 100, p, len(a), len(b)))
+
+  only = len(set(base) ^ set(cand))
+  print("%d metrics compared, %d regressed, %d skipped (too few runs), "
+        "%d configs in only one set" % (compared, regressions, skipped, only))
+  return 1 if regressions else 0
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Load the JSON Lines results every benchmark appends to $RESULTS_FILE (see
+# ../results.h), and flatten them into one dict per record, e.g.
+#
+#   {'run_id': ..., 'benchmark': 'ctxswitch', 'library': 'upthread',
+#    'test': 'CTXSWITCH', 'machine.host': ..., 'params.ncpus': 4,
+#    'metrics.count': 1234, ...}
+#
+# Records a benchmark flagged as measured under OS noise ("noisy": true, see
+# ../jitter.h) are left out unless asked for.
+#
+# Run as a script to convert results files to CSV:
+#
+#   results.py nightly/*.jsonl > all.csv
+
+from __future__ import print_function
+import os
+import sys
+import csv
+import glob
+import json
+
+SCHEMA = 1
+
+def flatten(record, prefix=''):
+  flat = {}
+  for k, v in record.items():
+    if isinstance(v, dict):
+      flat.update(flatten(v, prefix + k + '.'))
+    else:
+      flat[prefix + k] = v
+  return flat
+
+def load(paths, include_noisy=False):
+  """Load every record in the given files (or directories of *.jsonl)."""
+  records = []
+  skipped = 0
+  for path in paths:
+    files = [path]
+    if os.path.isdir(path):
+      files = sorted(glob.glob(os.path.join(path, '*.jsonl')))
+    for f in files:
+      for n, line in enumerate(open(f)):
+        line = line.strip()
+        if not line:
+          continue
+        try:
+          record = json.loads(line)
+        except ValueError:
+          print("%s:%d: skipping malformed record" % (f, n + 1),
+                file=sys.stderr)
+          continue
+        if record.get('schema', 0) > SCHEMA:
+          print("%s:%d: schema %d is newer than %d" %
+                (f, n + 1, record['schema'], SCHEMA), file=sys.stderr)
+        if record.get('noisy') and not include_noisy:
+          skipped += 1
+          continue
+        records.append(flatten(record))
+  if skipped:
+    print("skipped %d noisy records" % skipped, file=sys.stderr)
+  return records
+
+def select(records, **kwargs):
+  """The records whose fields match all of kwargs, with '.' spelled '__',
+     e.g. select(records, benchmark='pi', params__nr_threads=8)."""
+  want = dict((k.replace('__', '.'), v) for k, v in kwargs.items())
+  return [r for r in records
+          if all(r.get(k) == v for k, v in want.items())]
+
+def write_csv(records, out):
+  fields = sorted(set(k for r in records for k in r))
+  w = csv.DictWriter(out, fieldnames=fields)
+  w.writeheader()
+  for r in records:
+    w.writerow(r)
+
+if __name__ == '__main__':
+  if len(sys.argv) < 2:
+    print("usage: %s <results.jsonl | dir>..." % sys.argv[0], file=sys.stderr)
+    sys.exit(1)
+  write_csv(load(sys.argv[1:]), sys.stdout)
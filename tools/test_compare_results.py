@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+#
+# Author: Kevin Klues <klueska@cs.berkeley.edu>
+#
+# Tests for compare_results.py:
+#
+#   python -m unittest test_compare_results
+
+from __future__ import print_function
+import os
+import sys
+import json
+import shutil
+import tempfile
+import unittest
+
+import compare_results
+
+def fixedwork_run(seed, run_ms):
+  """A flattened fixedwork "run" record, as results.load() returns it."""
+  return {'run_id': 'host-%d' % seed, 'benchmark': 'fixedwork',
+          'library': 'upthread-juggle', 'test': 'run',
+          'params.nr_threads': 1024, 'params.nr_loops': 300000,
+          'params.fake_work': 1000, 'params.preempt_period': 10000,
+          'params.work_dist': 'fixed', 'params.delay_dist': 'none',
+          'params.seed': seed, 'metrics.run_ms': run_ms}
+
+class DeriveTest(unittest.TestCase):
+  def test_seeds_share_a_config(self):
+    records = [fixedwork_run(i, 100.0 + i) for i in range(1, 6)]
+    samples = compare_results.derive(records)
+    self.assertEqual(len(samples), 1)
+    key = list(samples)[0]
+    self.assertNotIn('seed', dict(key[3]))
+    self.assertEqual(sorted(samples[key]['run_ms']),
+                     [101.0, 102.0, 103.0, 104.0, 105.0])
+
+def wakeup_run(n, p99_ns, tag):
+  """A wakeup record as results.h writes it, with a fixed throughput."""
+  return {'schema': 1, 'run_id': '%s-%d' % (tag, n), 'benchmark': 'wakeup',
+          'library': 'upthread-pvcq', 'test': 'wakeup',
+          'params': {'nr_waiters': 4, 'nr_load': 4, 'interval': 100},
+          'metrics': {'tsc_freq': 1000000000, 'beg': 0, 'end': 1000000000,
+                      'count': 10000, 'p50_ns': 2000 + n,
+                      'p99_ns': p99_ns + n}}
+
+class CompareTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.mkdtemp()
+
+  def tearDown(self):
+    shutil.rmtree(self.dir)
+
+  def write(self, name, records):
+    path = os.path.join(self.dir, name)
+    with open(path, 'w') as f:
+      for r in records:
+        print(json.dumps(r), file=f)
+    return path
+
+  def compare(self, base, cand):
+    argv = sys.argv
+    sys.argv = ['compare_results.py', base, cand]
+    try:
+      return compare_results.main()
+    finally:
+      sys.argv = argv
+
+  def test_latency_only_regression(self):
+    base = self.write('base.jsonl', [wakeup_run(i, 10000, 'a')
+                                     for i in range(8)])
+    cand = self.write('cand.jsonl', [wakeup_run(i, 15000, 'b')
+                                     for i in range(8)])
+    samples = compare_results.derive(compare_results.results.load([cand]))
+    self.assertIn('p99_ns', list(samples.values())[0])
+    self.assertEqual(self.compare(base, cand), 1)
+    self.assertEqual(self.compare(base, base), 0)
+
+if __name__ == '__main__':
+  unittest.main()
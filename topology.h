@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ *
+ * This file is part of Parlib.
+ *
+ * Parlib is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Parlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ *
+ * See COPYING.LESSER for details on the GNU Lesser General Public License.
+ * See COPYING for details on the GNU General Public License.
+ */
+
+/* Cpu topology discovery and thread placement for the multicore benchmarks.
+ * topology_init() reads the sockets, cores, SMT siblings and NUMA nodes out
+ * of sysfs and builds a placement map from the PLACEMENT environment
+ * variable:
+ *
+ *   linear   - thread i on cpu i (the default, and what we always did)
+ *   compact  - fill one node at a time, physical cores before SMT siblings
+ *   smt      - fill one node at a time, SMT siblings next to each other
+ *   physical - one thread per physical core across all nodes, then siblings
+ *   scatter  - round robin across nodes, physical cores before siblings
+ *
+ * Thread i then runs on placement_cpu(i), and node_alloc() hands out memory
+ * that prefers a given node, for per-thread data. */
+
+#ifndef BENCHMARKS_TOPOLOGY_H
+#define BENCHMARKS_TOPOLOGY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/param.h> /* MAX */
+#include <parlib/arch.h>
+#include "results.h"
+
+#define MPOL_PREFERRED 1
+#define NODE_ARENA_SIZE (2 * 1024 * 1024)
+#define MAX_NODES 64
+
+struct cpu_info {
+	int cpu;
+	int package;
+	int core;
+	int node;
+	int smt;        /* index among the SMT siblings of this physical core */
+	int core_rank;  /* index of this physical core within its node */
+};
+
+static struct topology {
+	const char *policy;
+	int nr_cpus;
+	int nr_nodes;
+	int nr_cores;
+	struct cpu_info *cpus;
+	int *placement;
+} topology;
+
+static struct node_arena {
+	char *next;
+	char *end;
+} node_arenas[MAX_NODES];
+
+static inline void pin_to_core(int core)
+{
+	cpu_set_t c;
+	CPU_ZERO(&c);
+	CPU_SET(core, &c);
+	sched_setaffinity(0, sizeof(cpu_set_t), &c);
+	sched_yield();
+}
+
+static int __topo_read_int(const char *fmt, int arg, int def)
+{
+	char path[128];
+	int val = def;
+	snprintf(path, sizeof(path), fmt, arg);
+	FILE *f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%d", &val) != 1)
+			val = def;
+		fclose(f);
+	}
+	return val;
+}
+
+/* Parse a sysfs cpu/node list like "0-3,8-11" into vals; returns the count,
+ * or -1 if the file can't be read. */
+static int __topo_read_list(const char *path, int *vals, int max)
+{
+	char buf[4096];
+	int n = 0;
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	for (char *tok = strtok(buf, ",\n"); tok; tok = strtok(NULL, ",\n")) {
+		char *end;
+		int lo = strtol(tok, &end, 10);
+		int hi = *end == '-' ? strtol(end + 1, 0, 10) : lo;
+		for (int i = lo; i <= hi && n < max; i++)
+			vals[n++] = i;
+	}
+	return n;
+}
+
+static int __topo_key[3];
+
+static int __topo_field(struct cpu_info *c, int key)
+{
+	switch (key) {
+		case 0: return c->node;
+		case 1: return c->smt;
+		case 2: return c->core_rank;
+		default: return c->cpu;
+	}
+}
+
+static int __topo_cmp(const void *a, const void *b)
+{
+	struct cpu_info *x = (struct cpu_info*)a, *y = (struct cpu_info*)b;
+	for (int i = 0; i < 3; i++) {
+		int d = __topo_field(x, __topo_key[i]) - __topo_field(y, __topo_key[i]);
+		if (d)
+			return d;
+	}
+	return x->cpu - y->cpu;
+}
+
+static int __topo_cmp_core(const void *a, const void *b)
+{
+	struct cpu_info *x = (struct cpu_info*)a, *y = (struct cpu_info*)b;
+	if (x->node != y->node)
+		return x->node - y->node;
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core != y->core)
+		return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+
+static inline void topology_init(void)
+{
+	int nprocs = sysconf(_SC_NPROCESSORS_CONF);
+	int *online = malloc(sizeof(int) * nprocs);
+	int *list = malloc(sizeof(int) * nprocs);
+	int nodes[MAX_NODES];
+	char path[128];
+
+	topology.nr_cpus = __topo_read_list("/sys/devices/system/cpu/online",
+	                                    online, nprocs);
+	if (topology.nr_cpus < 0) {
+		topology.nr_cpus = nprocs;
+		for (int i = 0; i < nprocs; i++)
+			online[i] = i;
+	}
+	topology.cpus = calloc(topology.nr_cpus, sizeof(struct cpu_info));
+	for (int i = 0; i < topology.nr_cpus; i++) {
+		struct cpu_info *c = &topology.cpus[i];
+		c->cpu = online[i];
+		c->package = __topo_read_int(
+			"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			c->cpu, 0);
+		c->core = __topo_read_int(
+			"/sys/devices/system/cpu/cpu%d/topology/core_id", c->cpu, c->cpu);
+	}
+
+	/* Machines without NUMA have no node directory: everything is node 0. */
+	topology.nr_nodes = __topo_read_list("/sys/devices/system/node/online",
+	                                     nodes, MAX_NODES);
+	if (topology.nr_nodes <= 0)
+		topology.nr_nodes = 1;
+	for (int n = 0; n < topology.nr_nodes && topology.nr_nodes > 1; n++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		         nodes[n]);
+		int nr = __topo_read_list(path, list, nprocs);
+		for (int j = 0; j < nr; j++)
+			for (int i = 0; i < topology.nr_cpus; i++)
+				if (topology.cpus[i].cpu == list[j])
+					topology.cpus[i].node = nodes[n];
+	}
+
+	/* Number the SMT siblings of each physical core, and the physical cores
+	 * of each node. */
+	qsort(topology.cpus, topology.nr_cpus, sizeof(struct cpu_info),
+	      __topo_cmp_core);
+	topology.nr_cores = 0;
+	for (int i = 0, rank = 0; i < topology.nr_cpus; i++) {
+		struct cpu_info *c = &topology.cpus[i], *p = c - 1;
+		if (i > 0 && p->node == c->node && p->package == c->package
+		          && p->core == c->core) {
+			c->smt = p->smt + 1;
+			c->core_rank = p->core_rank;
+			continue;
+		}
+		if (i > 0 && p->node != c->node)
+			rank = 0;
+		c->smt = 0;
+		c->core_rank = rank++;
+		topology.nr_cores++;
+	}
+
+	/* Build the placement map for the requested policy. */
+	topology.policy = getenv("PLACEMENT") ? getenv("PLACEMENT") : "linear";
+	if (!strcmp(topology.policy, "compact"))
+		memcpy(__topo_key, (int[]){0, 1, 2}, sizeof(__topo_key));
+	else if (!strcmp(topology.policy, "smt"))
+		memcpy(__topo_key, (int[]){0, 2, 1}, sizeof(__topo_key));
+	else if (!strcmp(topology.policy, "physical"))
+		memcpy(__topo_key, (int[]){1, 0, 2}, sizeof(__topo_key));
+	else if (!strcmp(topology.policy, "scatter"))
+		memcpy(__topo_key, (int[]){1, 2, 0}, sizeof(__topo_key));
+	else {
+		if (strcmp(topology.policy, "linear"))
+			fprintf(stderr, "Unknown placement '%s', using linear\n",
+			        topology.policy);
+		topology.policy = "linear";
+		memcpy(__topo_key, (int[]){3, 3, 3}, sizeof(__topo_key));
+	}
+	qsort(topology.cpus, topology.nr_cpus, sizeof(struct cpu_info),
+	      __topo_cmp);
+	topology.placement = malloc(sizeof(int) * topology.nr_cpus);
+	for (int i = 0; i < topology.nr_cpus; i++)
+		topology.placement[i] = topology.cpus[i].cpu;
+
+	free(online);
+	free(list);
+}
+
+/* The cpu the i'th thread should run on.  Wraps if there are more threads
+ * than cpus. */
+static inline int placement_cpu(int i)
+{
+	return topology.placement[i % topology.nr_cpus];
+}
+
+static inline int cpu_node(int cpu)
+{
+	for (int i = 0; i < topology.nr_cpus; i++)
+		if (topology.cpus[i].cpu == cpu)
+			return topology.cpus[i].node;
+	return 0;
+}
+
+/* Cache line aligned memory that prefers to live on 'node'.  Carved out of
+ * a per-node arena and never freed. */
+static inline void *node_alloc(size_t size, int node)
+{
+	struct node_arena *a = &node_arenas[node % MAX_NODES];
+	size = (size + ARCH_CL_SIZE - 1) & ~(ARCH_CL_SIZE - 1);
+	if (a->next + size > a->end) {
+		size_t len = MAX(size, NODE_ARENA_SIZE);
+		void *arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		/* No arena, no node preference: just take plain memory. */
+		if (arena == MAP_FAILED) {
+			void *ret = aligned_alloc(ARCH_CL_SIZE, size);
+			if (!ret) {
+				perror("node_alloc");
+				exit(1);
+			}
+			return ret;
+		}
+		a->next = arena;
+		a->end = a->next + len;
+		/* Best effort: fine to fail without NUMA, and pages still land on
+		 * the first node to touch them. */
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, a->next, len, MPOL_PREFERRED, &mask,
+		        sizeof(mask) * 8, 0);
+	}
+	void *ret = a->next;
+	a->next += size;
+	return ret;
+}
+
+static inline void print_topology(FILE *f, int nthreads)
+{
+	fprintf(f, "Placement: %s (%d nodes, %d cores, %d cpus):",
+	        topology.policy, topology.nr_nodes, topology.nr_cores,
+	        topology.nr_cpus);
+	for (int i = 0; i < nthreads; i++)
+		fprintf(f, " %d", placement_cpu(i));
+	fprintf(f, "\n");
+}
+
+/* Record the whole placement map, in the order cpus are handed out, as a
+ * "topology" record, so the machine readable runs keep it too.  Runs of
+ * consecutive cpus are written as ranges, like "0-7,16-23". */
+static inline void result_topology(void)
+{
+	char map[768];
+	size_t n = 0;
+	struct result r;
+
+	if (!results_enabled())
+		return;
+	map[0] = '\0';
+	for (int i = 0; i < topology.nr_cpus && n < sizeof(map); ) {
+		int j = i;
+		while (j + 1 < topology.nr_cpus
+		       && topology.placement[j + 1] == topology.placement[j] + 1)
+			j++;
+		if (j > i)
+			n += snprintf(map + n, sizeof(map) - n, "%s%d-%d", i ? "," : "",
+			              topology.placement[i], topology.placement[j]);
+		else
+			n += snprintf(map + n, sizeof(map) - n, "%s%d", i ? "," : "",
+			              topology.placement[i]);
+		i = j + 1;
+	}
+	result_begin(&r, "topology");
+	result_param_str(&r, "placement", topology.policy);
+	__result_add_to(&r, params, "map", "\"%s\"", map);
+	result_metric_int(&r, "nr_nodes", topology.nr_nodes);
+	result_metric_int(&r, "nr_cores", topology.nr_cores);
+	result_metric_int(&r, "nr_cpus", topology.nr_cpus);
+	result_end(&r);
+}
+
+#endif /* BENCHMARKS_TOPOLOGY_H */
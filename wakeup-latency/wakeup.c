@@ -0,0 +1,269 @@
+/* Copyright (c) 2014 The Regents of the University of California
+ * Kevin Klues <klueska@cs.berkeley.edu>
+ * See LICENSE for details. */
+
+/* Scheduler wakeup latency, cyclictest style.  Each waiter thread has a
+ * deadline every 'interval' microseconds.  When a deadline passes the thread
+ * is runnable again, and we stamp how long it takes until it actually runs.
+ * Meanwhile, 'nr_load' threads run fixedwork's loop to keep the cpus busy.
+ *
+ *   mode 0 (poll)  - waiters pthread_yield() until their deadline, so the
+ *                    latency is how long the scheduler takes to come back to
+ *                    a runnable thread.  Works with every library.
+ *   mode 1 (sleep) - waiters clock_nanosleep() until their deadline, so the
+ *                    latency includes the kernel's timer wakeup.  Native
+ *                    pthreads only; a sleeping upthread would block its whole
+ *                    vcore.
+ *
+ * usage: wakeup [nr_waiters] [nr_load] [duration] [interval] [fake_work]
+ *               [human] [preempt_period] [mode] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <parlib/timing.h>
+#include <parlib/arch.h>
+#include "../libconfig.h"
+#include "../barrier.h"
+#include "../results.h"
+#include "../histogram.h"
+#include "../cpuusage.h"
+
+/* Modifiable via command line */
+int nr_waiters = 4;
+int nr_load = 4;
+int duration = 10;
+int interval = 1000;
+int fake_work = 10000;
+int human = 1;
+int preempt_period = PREEMPT_PERIOD;
+int mode = 0;
+
+/* Latencies are kept in tsc ticks. */
+struct waiter {
+	uint64_t overruns;
+	uint64_t polls;
+	struct histogram lat;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct load {
+	uint64_t loops;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct waiter *waiters;
+static struct load *loads;
+static pthread_t *thandles;
+static struct tree_barrier barrier;
+static uint64_t start_tsc;
+static struct timespec start_mono;
+static volatile bool stop;
+static int waiters_done;
+
+static void timespec_add_usec(struct timespec *ts, uint64_t usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *waiter_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct waiter *w = &waiters[id];
+	/* Stagger the waiters across the interval. */
+	uint64_t next_usec = interval + (uint64_t)interval * id / nr_waiters;
+
+	tree_barrier_wait(&barrier, id + 1);
+	cmb();
+	uint64_t end = start_tsc + sec2tsc(duration);
+	while (1) {
+		uint64_t next = start_tsc + usec2tsc(next_usec);
+		if (next >= end)
+			break;
+		if (mode == 1) {
+			struct timespec ts = start_mono;
+			timespec_add_usec(&ts, next_usec);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			                       NULL))
+				;
+		} else {
+			while (read_tsc() < next) {
+				pthread_yield();
+				w->polls++;
+			}
+		}
+		uint64_t now = read_tsc();
+		hist_add(&w->lat, now > next ? now - next : 0);
+
+		/* Skip deadlines we slept straight through, like cyclictest. */
+		next_usec += interval;
+		while (start_tsc + usec2tsc(next_usec) <= now) {
+			next_usec += interval;
+			w->overruns++;
+		}
+	}
+
+	/* The last waiter out stops the load. */
+	if (__sync_add_and_fetch(&waiters_done, 1) == nr_waiters)
+		stop = true;
+	return NULL;
+}
+
+/* fixedwork's loop, run until the waiters are done.  Without WITH_YIELD a
+ * cooperative library never gets a waiter sharing our vcore back in to say
+ * so, so the run's own deadline (plus a second of slack for the waiters to
+ * finish normally) stops us too. */
+static void *load_thread(void *arg)
+{
+	int id = (int)(long)arg;
+	struct load *l = &loads[id];
+
+	tree_barrier_wait(&barrier, nr_waiters + id + 1);
+	uint64_t end = start_tsc + sec2tsc(duration + 1);
+	while (!stop && read_tsc() < end) {
+		for (int j=0; j<fake_work; j++)
+			cmb();
+		l->loops++;
+		#ifdef WITH_YIELD
+		pthread_yield();
+		#endif
+	}
+	return NULL;
+}
+
+static void parse_args(int argc, char **argv)
+{
+	if (argc > 1)
+		nr_waiters = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		nr_load = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		duration = strtol(argv[3], 0, 10);
+	if (argc > 4)
+		interval = strtol(argv[4], 0, 10);
+	if (argc > 5)
+		fake_work = strtol(argv[5], 0, 10);
+	if (argc > 6)
+		human = strtol(argv[6], 0, 10);
+	if (argc > 7)
+		preempt_period = strtol(argv[7], 0, 10);
+	if (argc > 8)
+		mode = strtol(argv[8], 0, 10);
+}
+
+int main(int argc, char **argv)
+{
+	parse_args(argc, argv);
+	results_init("wakeup", argc, argv);
+#ifndef USE_PTHREAD
+	if (mode == 1) {
+		fprintf(stderr, "sleep mode would block a whole vcore, "
+		                "using poll mode\n");
+		mode = 0;
+	}
+#endif
+
+	int nr_threads = nr_waiters + nr_load;
+	size_t wsize = sizeof(struct waiter) * nr_waiters;
+	size_t lsize = sizeof(struct load) * MAX(nr_load, 1);
+	waiters = aligned_alloc(ARCH_CL_SIZE, wsize);
+	memset(waiters, 0, wsize);
+	loads = aligned_alloc(ARCH_CL_SIZE, lsize);
+	memset(loads, 0, lsize);
+	thandles = calloc(nr_threads, sizeof(pthread_t));
+
+	/* Do any library specific test prep */
+	test_prep();
+	tree_barrier_init(&barrier, nr_threads + 1,
+	                  TREE_BARRIER_YIELD | TREE_BARRIER_GATED);
+	for (int i = 0; i < nr_waiters; i++)
+		pthread_create(&thandles[i], NULL, waiter_thread,
+		               (void*)(long)i);
+	for (int i = 0; i < nr_load; i++)
+		pthread_create(&thandles[nr_waiters + i], NULL, load_thread,
+		               (void*)(long)i);
+
+	/* Everyone's deadlines count from here. */
+	struct cpu_usage usage;
+	tree_barrier_gather(&barrier, 0);
+	cpu_usage_begin(&usage);
+	clock_gettime(CLOCK_MONOTONIC, &start_mono);
+	start_tsc = read_tsc();
+	tree_barrier_release(&barrier);
+
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(thandles[i], NULL);
+	cpu_usage_end(&usage);
+
+	/* Merge the waiters' histograms. */
+	static struct histogram lat;
+	uint64_t overruns = 0, load_loops = 0;
+	uint64_t spins = tree_barrier_spins(&barrier);
+	for (int i = 0; i < nr_waiters; i++) {
+		hist_merge(&lat, &waiters[i].lat);
+		overruns += waiters[i].overruns;
+		spins += waiters[i].polls;
+	}
+	uint64_t samples = lat.samples;
+	for (int i = 0; i < nr_load; i++)
+		load_loops += loads[i].loops;
+	if (!samples) {
+		fprintf(stderr, "No deadlines fell within the run\n");
+		return 1;
+	}
+
+	double pcts[] = {50, 90, 99, 99.9};
+	uint64_t pct_ns[4];
+	for (int i = 0; i < 4; i++)
+		pct_ns[i] = tsc2nsec(hist_percentile(&lat, pcts[i]));
+	uint64_t mean_ns = tsc2nsec(hist_mean(&lat));
+	uint64_t max_ns = tsc2nsec(lat.max);
+
+	if (human) {
+		printf("Wakeup latency (%s mode): %d waiters, %d load threads, "
+		       "interval: %dus, preempt period: %dus\n",
+		       mode ? "sleep" : "poll", nr_waiters, nr_load, interval,
+		       preempt_period);
+		printf("  samples:  %ld (%ld overruns)\n", samples, overruns);
+		printf("  mean:     %ldns\n", mean_ns);
+		printf("  p50:      %ldns\n", pct_ns[0]);
+		printf("  p90:      %ldns\n", pct_ns[1]);
+		printf("  p99:      %ldns\n", pct_ns[2]);
+		printf("  p99.9:    %ldns\n", pct_ns[3]);
+		printf("  max:      %ldns\n", max_ns);
+		printf("  load:     %ld loops\n", load_loops);
+		print_cpu_usage(stdout, &usage, load_loops, spins);
+	} else {
+		printf("%d:%d:%d:%d:%d:%d:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld:%ld\n",
+		       nr_waiters, nr_load, interval, preempt_period, mode, duration,
+		       samples, overruns, mean_ns, pct_ns[0], pct_ns[1], pct_ns[2],
+		       pct_ns[3], max_ns, load_loops);
+	}
+
+	struct result r;
+	result_begin(&r, mode ? "sleep" : "poll");
+	result_param_int(&r, "nr_waiters", nr_waiters);
+	result_param_int(&r, "nr_load", nr_load);
+	result_param_int(&r, "duration", duration);
+	result_param_int(&r, "interval", interval);
+	result_param_int(&r, "fake_work", fake_work);
+	result_param_int(&r, "preempt_period", preempt_period);
+	result_metric_int(&r, "samples", samples);
+	result_metric_int(&r, "overruns", overruns);
+	result_metric_int(&r, "mean_ns", mean_ns);
+	result_metric_int(&r, "p50_ns", pct_ns[0]);
+	result_metric_int(&r, "p90_ns", pct_ns[1]);
+	result_metric_int(&r, "p99_ns", pct_ns[2]);
+	result_metric_int(&r, "p999_ns", pct_ns[3]);
+	result_metric_int(&r, "max_ns", max_ns);
+	result_metric_int(&r, "load_loops", load_loops);
+	result_cpu_usage(&r, &usage, load_loops, spins);
+	result_end(&r);
+	return 0;
+}